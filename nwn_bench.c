@@ -0,0 +1,448 @@
+// license:BSD-3-Clause
+// copyright-holders:Jonathan Gevaryahu
+// (C) 2020-2022 Jonathan Gevaryahu AKA Lord Nightmare
+// the library is built in, rather than linked, so that the stages ltr_load
+// runs can be timed one at a time
+#include "nwn_ltr.c"
+
+// benchmarks for libnwnltr on synthetic .ltr files
+//
+// Every corpus is made from a fixed seed: random names are drawn letter by
+// letter, each letter only able to follow the previous one from a fixed
+// random set of 'followers' letters, and counted into an .ltr image the same
+// way Bioware's tool does, optionally including its corrupt singles bug. Each
+// load stage is timed on its own over several repetitions, and generation is
+// timed per name for every sampler, as is the rng on its own. Results are
+// written as JSON.
+
+typedef struct s_cfg
+{
+	u32 generate;
+	u32 reps;
+	u32 threads;
+	const char* outfile;
+	const char* writedir;
+} s_cfg;
+
+typedef struct bench_corpus
+{
+	const char* name;
+	u8 num_letters;
+	u32 names;
+	u8 followers; // letters each letter can be followed by; lower is sparser
+	bool corrupt; // reproduce the corrupt singles middle/end rows
+	u32 seed;
+} bench_corpus;
+
+static const bench_corpus corpora[] =
+{
+	{ "one",    1,   200,  1, false, 1 },
+	{ "d8",     8,   500,  8, false, 2 },
+	{ "s16",   16,  1000,  3, true,  3 },
+	{ "d26",   26,  2000, 26, true,  4 },
+	{ "s28",   28,  1500,  4, true,  5 },
+	{ "d28big",28, 20000, 28, true,  6 },
+};
+#define NUM_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+#define BENCH_MINLEN (4)
+#define BENCH_MAXLEN (12)
+
+// load stages, in the order ltr_load runs them, and then the output stages
+enum { ST_DECODE, ST_FIX, ST_ANALYZE, ST_BUILD, ST_PRINT, ST_DUMPSTART, NUM_STAGES };
+static const char* stage_names[NUM_STAGES] = { "decode", "fix", "analyze", "build", "print", "dumpstart" };
+
+static const char* sampler_names[] = { "cdf", "alias", "lut", "sparse", "count" };
+
+void usage()
+{
+	printf("Usage: nwn_bench [options]\n");
+	printf("Benchmark loading, analyzing and generating from synthetic .ltr files\n");
+	printf("Optional parameters:\n");
+	printf("-g #\t: names to generate per sampler and corpus (Default: 200000)\n");
+	printf("-r #\t: repetitions of each load stage (Default: 5)\n");
+	printf("-j #\t: threads used by the analysis (Default: 1)\n");
+	printf("-o file\t: write the JSON results to file (Default: stdout)\n");
+	printf("-w dir\t: also write the synthetic .ltr files to dir\n");
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+	u64 x = *(const u64*)a;
+	u64 y = *(const u64*)b;
+	return (x > y) - (x < y);
+}
+
+// value at fraction q of a sorted array
+static u64 percentile(const u64* v, u32 n, double q)
+{
+	return v[(u32)(q * (n - 1))];
+}
+
+// build the .ltr image for a corpus; returns its size, or 0 if out of memory
+static u32 corpus_build(const bench_corpus* b, u8** out)
+{
+	u8 n = b->num_letters;
+	u32 num_tables = LTR_NUM_TABLES(n);
+	u32 len = 8 + 1 + (num_tables * 3 * n * sizeof(float));
+	u32* counts = calloc(num_tables * 3 * n, sizeof(u32));
+	u8* follow = malloc(n * n);
+	u8* data = malloc(len);
+	if (!counts || !follow || !data)
+	{
+		free(counts);
+		free(follow);
+		free(data);
+		return 0;
+	}
+#define COUNT(t,r,i) counts[((((t) * 3) + (r)) * n) + (i)]
+
+	ms_rng r;
+	ms_srand(&r, b->seed);
+	// each letter's followers are the first 'followers' of a shuffle
+	for (u32 a = 0; a < n; a++)
+	{
+		u8* f = follow + (a * n);
+		for (u32 i = 0; i < n; i++)
+			f[i] = i;
+		for (u32 i = n - 1; i > 0; i--)
+		{
+			u32 j = ms_rand(&r) % (i + 1);
+			u8 tmp = f[i];
+			f[i] = f[j];
+			f[j] = tmp;
+		}
+	}
+
+	for (u32 w = 0; w < b->names; w++)
+	{
+		u8 s[BENCH_MAXLEN];
+		u32 len = BENCH_MINLEN + (ms_rand(&r) % (BENCH_MAXLEN - BENCH_MINLEN + 1));
+		s[0] = ms_rand(&r) % n;
+		for (u32 i = 1; i < len; i++)
+			s[i] = follow[(s[i-1] * n) + (ms_rand(&r) % b->followers)];
+		COUNT(LTR_SINGLES, ROW_START, s[0])++;
+		COUNT(1 + s[0], ROW_START, s[1])++;
+		COUNT(1 + n + (s[0] * n) + s[1], ROW_START, s[2])++;
+		for (u32 i = 1; i < len - 1; i++)
+		{
+			COUNT(LTR_SINGLES, ROW_MIDDLE, s[i])++;
+			COUNT(1 + s[i-1], ROW_MIDDLE, s[i])++;
+			if (i >= 2)
+				COUNT(1 + n + (s[i-2] * n) + s[i-1], ROW_MIDDLE, s[i])++;
+		}
+		COUNT(LTR_SINGLES, ROW_END, s[len-1])++;
+		COUNT(1 + s[len-2], ROW_END, s[len-1])++;
+		COUNT(1 + n + (s[len-3] * n) + s[len-2], ROW_END, s[len-1])++;
+	}
+
+	memcpy(data, "LTR V1.0", 8);
+	data[8] = n;
+	u8* p = data + 9;
+	for (u32 t = 0; t < num_tables; t++)
+	{
+		for (u32 row = 0; row < 3; row++)
+		{
+			// Bioware's bug restarts the running sum after every zero entry
+			bool bug = b->corrupt && (t == LTR_SINGLES) && (row != ROW_START);
+			u32 total = 0;
+			for (u32 i = 0; i < n; i++)
+				total += COUNT(t, row, i);
+			float acc = 0.0;
+			for (u32 i = 0; i < n; i++, p += 4)
+			{
+				u32 v = COUNT(t, row, i);
+				if (v == 0)
+				{
+					if (bug)
+						acc = 0.0;
+					put_f(p, 0.0);
+					continue;
+				}
+				acc += (float)v / total;
+				put_f(p, acc);
+			}
+		}
+	}
+#undef COUNT
+	free(counts);
+	free(follow);
+	*out = data;
+	return len;
+}
+
+// time each load stage over reps repetitions; the fastest run is the
+// headline figure, and the median is kept to show the spread
+static bool bench_load(const u8* data, u32 len, s_cfg* cfg, u64 (*times)[NUM_STAGES], FILE* devnull)
+{
+	ltr_opts c = { true, cfg->threads, 0 };
+	for (u32 rep = 0; rep < cfg->reps; rep++)
+	{
+		ltrfile* l = NULL;
+		u64 t0 = ltr_clock_ns();
+		if (ltr_decode(data, len, &l, c) != LTR_OK)
+			return false;
+		u64 t1 = ltr_clock_ns();
+		ltr_fix(l, c);
+		u64 t2 = ltr_clock_ns();
+		ltr_analyze(l, c);
+		u64 t3 = ltr_clock_ns();
+		bool built = ltr_build_samplers(l, c);
+		u64 t4 = ltr_clock_ns();
+		ltr_print(l, 2, devnull);
+		u64 t5 = ltr_clock_ns();
+		ltr_dumpstart(l, devnull);
+		u64 t6 = ltr_clock_ns();
+		ltr_free(l);
+		if (!built)
+			return false;
+		times[rep][ST_DECODE] = t1 - t0;
+		times[rep][ST_FIX] = t2 - t1;
+		times[rep][ST_ANALYZE] = t3 - t2;
+		times[rep][ST_BUILD] = t4 - t3;
+		times[rep][ST_PRINT] = t5 - t4;
+		times[rep][ST_DUMPSTART] = t6 - t5;
+	}
+	return true;
+}
+
+// throughput of ltr_gen_batch, then every name timed on its own
+static bool bench_generate(const ltrfile* l, u32 sampler, bool prune, s_cfg* cfg, u64 timer_ns, FILE* out)
+{
+	ltr_gen_opts go = { BENCH_MAXLEN, sampler, prune, 1, 0 };
+	ltrgen* g = NULL;
+	ltr_batch b;
+	u64* ns = malloc(cfg->generate * sizeof(u64));
+	if (!ns || (ltr_gen_new(l, &go, 12345, &g) != LTR_OK) || !ltr_batch_init(&b, (size_t)cfg->generate * 16, cfg->generate))
+	{
+		free(ns);
+		if (g)
+			ltr_gen_free(g);
+		return false;
+	}
+	u64 t0 = ltr_clock_ns();
+	u32 made = ltr_gen_batch(g, &b, cfg->generate);
+	u64 t1 = ltr_clock_ns();
+	u64 chars = b.offsets[made] - b.offsets[0];
+	ltr_batch_free(&b);
+	ltr_gen_stats st;
+	ltr_gen_get_stats(g, &st);
+
+	char name[LTR_NAME_MAX];
+	for (u32 i = 0; i < cfg->generate; i++)
+	{
+		u64 s = ltr_clock_ns();
+		ltr_gen_name(g, name);
+		ns[i] = ltr_clock_ns() - s;
+	}
+	ltr_gen_free(g);
+	qsort(ns, cfg->generate, sizeof(u64), cmp_u64);
+
+	double secs = (t1 - t0) / 1e9;
+	double rate = secs > 0 ? made / secs : 0.0;
+	eprintf(V_ERR,"  generate %-6s%s: %12.0f names/sec, ns/name p50 %llu p99 %llu, backtracks %llu restarts %llu pruned %llu\n",
+		sampler_names[sampler], prune ? "+prune" : "      ", rate, (unsigned long long)percentile(ns, cfg->generate, 0.5), (unsigned long long)percentile(ns, cfg->generate, 0.99),
+		(unsigned long long)st.backtracks, (unsigned long long)st.restarts, (unsigned long long)st.pruned);
+	fprintf(out, "{\"sampler\": \"%s\", \"prune\": %s, \"names\": %u, \"mean_length\": %.3f, \"names_per_sec\": %.0f"
+		", \"ns_per_name\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}"
+		", \"backtracks\": %llu, \"restarts\": %llu, \"pruned\": %llu, \"forced_ends\": %llu"
+		", \"timer_ns\": %llu}",
+		sampler_names[sampler], prune ? "true" : "false", made, made ? (double)chars / made : 0.0, rate,
+		(unsigned long long)percentile(ns, cfg->generate, 0.5), (unsigned long long)percentile(ns, cfg->generate, 0.9),
+		(unsigned long long)percentile(ns, cfg->generate, 0.99), (unsigned long long)percentile(ns, cfg->generate, 0.999),
+		(unsigned long long)ns[cfg->generate - 1],
+		(unsigned long long)st.backtracks, (unsigned long long)st.restarts, (unsigned long long)st.pruned, (unsigned long long)st.forced_ends,
+		(unsigned long long)timer_ns);
+	free(ns);
+	return true;
+}
+
+// ms_rand one draw at a time against ms_fill, in ns per draw; both draw the
+// same stream, so the checksums must agree
+#define BENCH_RNG_DRAWS (1 << 24)
+#define BENCH_RNG_BLOCK (4096)
+static bool bench_rng(FILE* out)
+{
+	ms_rng r;
+	u32 buf[BENCH_RNG_BLOCK];
+	u32 sum_serial = 0, sum_fill = 0;
+	ms_srand(&r, 12345);
+	u64 t0 = ltr_clock_ns();
+	for (u32 i = 0; i < BENCH_RNG_DRAWS; i++)
+		sum_serial += ms_rand(&r);
+	u64 t1 = ltr_clock_ns();
+	ms_srand(&r, 12345);
+	for (u32 i = 0; i < BENCH_RNG_DRAWS; i += BENCH_RNG_BLOCK)
+	{
+		ms_fill(&r, buf, BENCH_RNG_BLOCK);
+		for (u32 j = 0; j < BENCH_RNG_BLOCK; j++)
+			sum_fill += buf[j];
+	}
+	u64 t2 = ltr_clock_ns();
+	double serial = (double)(t1 - t0) / BENCH_RNG_DRAWS;
+	double fill = (double)(t2 - t1) / BENCH_RNG_DRAWS;
+	eprintf(V_ERR,"rng: ms_rand %.3f ns/draw, ms_fill %.3f ns/draw\n", serial, fill);
+	fprintf(out, ", \"rng\": {\"draws\": %u, \"serial_ns_per_draw\": %.3f, \"fill_ns_per_draw\": %.3f}", BENCH_RNG_DRAWS, serial, fill);
+	return sum_serial == sum_fill;
+}
+
+// cost of a pair of ltr_clock_ns() calls, which is included in every ns/name figure
+static u64 timer_overhead(void)
+{
+	u64 v[1001];
+	for (u32 i = 0; i < 1001; i++)
+	{
+		u64 s = ltr_clock_ns();
+		v[i] = ltr_clock_ns() - s;
+	}
+	qsort(v, 1001, sizeof(u64), cmp_u64);
+	return v[500];
+}
+
+static bool bench_corpus_run(const bench_corpus* b, s_cfg* cfg, u64 timer_ns, FILE* devnull, FILE* out)
+{
+	u8* data = NULL;
+	u32 len = corpus_build(b, &data);
+	if (!len)
+		return false;
+	if (cfg->writedir)
+	{
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s.ltr", cfg->writedir, b->name);
+		FILE* f = fopen(path, "wb");
+		if (!f || (fwrite(data, 1, len, f) != len) || fclose(f))
+			eprintf(V_ERR,"E* Unable to write %s!\n", path);
+	}
+
+	eprintf(V_ERR,"%s: %d letters, %d names, %d followers%s\n", b->name, b->num_letters, b->names, b->followers, b->corrupt ? ", corrupt singles" : "");
+	u64 (*times)[NUM_STAGES] = malloc(cfg->reps * sizeof(*times));
+	ltr_opts c = { true, cfg->threads, 0 };
+	ltrfile* l = NULL;
+	if (!times || !bench_load(data, len, cfg, times, devnull) || (ltr_load(data, len, &c, &l) != LTR_OK))
+	{
+		free(times);
+		free(data);
+		return false;
+	}
+
+	fprintf(out, "{\"name\": \"%s\", \"letters\": %u, \"names\": %u, \"followers\": %u, \"corrupt\": %s, \"seed\": %u, \"bytes\": %u,"
+		" \"rows\": %u, \"stored_rows\": %u, \"model_bytes\": %zu,\n\t\"stages\": {",
+		b->name, b->num_letters, b->names, b->followers, b->corrupt ? "true" : "false", b->seed, len,
+		LTR_NUM_TABLES(l->num_letters) * 3, l->num_rows - 1, ltr_model_bytes(l));
+	eprintf(V_ERR,"  model           : %10zu bytes, %u of %u rows stored\n", ltr_model_bytes(l), l->num_rows - 1, LTR_NUM_TABLES(l->num_letters) * 3);
+	for (u32 s = 0; s < NUM_STAGES; s++)
+	{
+		u64 v[cfg->reps];
+		for (u32 rep = 0; rep < cfg->reps; rep++)
+			v[rep] = times[rep][s];
+		qsort(v, cfg->reps, sizeof(u64), cmp_u64);
+		eprintf(V_ERR,"  %-16s: %10llu ns\n", stage_names[s], (unsigned long long)v[0]);
+		fprintf(out, "%s\"%s\": {\"min_ns\": %llu, \"median_ns\": %llu}", s ? ", " : "", stage_names[s], (unsigned long long)v[0], (unsigned long long)percentile(v, cfg->reps, 0.5));
+	}
+	fprintf(out, "},\n\t\"generate\": [");
+	bool ok = true;
+	for (u32 sampler = SAMPLER_CDF; ok && (sampler <= SAMPLER_COUNT); sampler++)
+	{
+		fprintf(out, "%s\n\t\t", (sampler != SAMPLER_CDF) ? "," : "");
+		ok = bench_generate(l, sampler, false, cfg, timer_ns, out);
+	}
+	// and the default sampler again with pruning, to show what it saves
+	fprintf(out, ",\n\t\t");
+	ok = ok && bench_generate(l, SAMPLER_LUT, true, cfg, timer_ns, out);
+	fprintf(out, "\n\t]}");
+	ltr_free(l);
+	free(times);
+	free(data);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	// defaults
+	s_cfg cfg =
+	{
+		200000 // generate
+		, 5 // reps
+		, 1 // threads
+		, NULL // outfile
+		, NULL // writedir
+	};
+
+// handle optional parameters
+	int paramidx = 1;
+	while (paramidx < argc)
+	{
+		switch (*(argv[paramidx]++))
+		{
+			case 'g':
+				paramidx++;
+				if (paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -g parameter!\n"); usage(); exit(1); }
+				if (!sscanf(argv[paramidx], "%u", &cfg.generate) || !cfg.generate) { eprintf(V_ERR,"E* Unable to parse argument for -g parameter!\n"); usage(); exit(1); }
+				paramidx++;
+				break;
+			case 'r':
+				paramidx++;
+				if (paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -r parameter!\n"); usage(); exit(1); }
+				if (!sscanf(argv[paramidx], "%u", &cfg.reps) || !cfg.reps) { eprintf(V_ERR,"E* Unable to parse argument for -r parameter!\n"); usage(); exit(1); }
+				paramidx++;
+				break;
+			case 'j':
+				paramidx++;
+				if (paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -j parameter!\n"); usage(); exit(1); }
+				if (!sscanf(argv[paramidx], "%u", &cfg.threads) || !cfg.threads || (cfg.threads > 1024)) { eprintf(V_ERR,"E* Unable to parse argument for -j parameter!\n"); usage(); exit(1); }
+				paramidx++;
+				break;
+			case 'o':
+				paramidx++;
+				if (paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -o parameter!\n"); usage(); exit(1); }
+				cfg.outfile = argv[paramidx];
+				paramidx++;
+				break;
+			case 'w':
+				paramidx++;
+				if (paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -w parameter!\n"); usage(); exit(1); }
+				cfg.writedir = argv[paramidx];
+				paramidx++;
+				break;
+			case '\0':
+				paramidx++;
+				break;
+			case '-':
+				// skip this character.
+				break;
+			default:
+				{ eprintf(V_ERR,"E* Invalid option!\n"); usage(); exit(1); }
+				break;
+		}
+	}
+
+	FILE* devnull = fopen("/dev/null", "w");
+	FILE* out = cfg.outfile ? fopen(cfg.outfile, "w") : stdout;
+	if (!devnull || !out)
+	{
+		eprintf(V_ERR,"E* Unable to open %s!\n", devnull ? cfg.outfile : "/dev/null");
+		return 1;
+	}
+
+	u64 timer_ns = timer_overhead();
+	fprintf(out, "{\"generate\": %u, \"reps\": %u, \"threads\": %u, \"corpora\": [\n\t",
+		cfg.generate, cfg.reps, cfg.threads);
+	bool ok = true;
+	for (u32 i = 0; ok && (i < NUM_CORPORA); i++)
+	{
+		if (i)
+			fprintf(out, ",\n\t");
+		ok = bench_corpus_run(&corpora[i], &cfg, timer_ns, devnull, out);
+		if (!ok)
+			eprintf(V_ERR,"E* Benchmark of %s failed!\n", corpora[i].name);
+	}
+	fprintf(out, "\n]");
+	if (ok && !(ok = bench_rng(out)))
+		eprintf(V_ERR,"E* ms_fill did not match ms_rand!\n");
+	// the cdf search kernel is picked when the first model is built
+	fprintf(out, ", \"cdf_search\": \"%s\"}\n", cdf_search_name);
+	fclose(devnull);
+	if (cfg.outfile && fclose(out))
+		ok = false;
+	return ok ? 0 : 1;
+}
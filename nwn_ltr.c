@@ -0,0 +1,5639 @@
+// license:BSD-3-Clause
+// copyright-holders:Jonathan Gevaryahu
+// (C) 2020-2022 Jonathan Gevaryahu AKA Lord Nightmare
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_PTHREAD
+#define HAVE_CLOCK_GETTIME
+#include <pthread.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+#include "nwn_ltr.h"
+
+// defines
+// max allowed threshold for absolute error for a match for two floats due to precision loss
+#define THRESH_MAXALLOWED 0.001
+// same for doubles
+#define THRESH_DMAXALLOWED 0.0000000001
+
+// largest table total the analysis will consider
+#define MAXTOTAL (30000)
+
+// .ltr file size limits, for 1 and 28 letters respectively
+#define MINFILESIZE (8+1+(sizeof(float)*((1*3)+(1*1*3)+(1*1*1*3))))
+#define MAXFILESIZE (8+1+(sizeof(float)*((28*3)+(28*28*3)+(28*28*28*3))))
+
+static const char ltr_letters[] = LTR_LETTERS;
+
+// nanoseconds on a monotonic clock, for the metrics, the trace and nwn_bench
+static u64 ltr_clock_ns(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u64)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+#else
+	return (u64)clock() * (1000000000ULL / CLOCKS_PER_SEC);
+#endif
+}
+
+/* metrics
+ *
+ * Builds with LTR_METRICS defined count how the library spends its time:
+ * timings of each load phase and of generating, and counters and
+ * histograms of how names come about. Everything that does so is wrapped in
+ * METRIC(), which is empty in other builds, so there it costs nothing at
+ * all. A generator counts into its own gen_metrics, with no locking, and
+ * adds them to the process totals when it is freed; the load phases add to
+ * the totals directly, under a lock.
+ */
+#ifdef LTR_METRICS
+#define METRIC(x) x
+#else
+#define METRIC(x)
+#endif
+
+#define METRIC_DECODE   (0)
+#define METRIC_FIX      (1)
+#define METRIC_ANALYZE  (2)
+#define METRIC_BUILD    (3)
+#define METRIC_COMPILED (4)
+#define METRIC_GENERATE (5)
+#define METRIC_PHASES   (6)
+
+#define METRIC_ROLL_BUCKETS (24) // bucket b counts names taking at most 2^b draws; the last takes the rest
+
+typedef struct gen_metrics
+{
+	u64 rolls; // rng draws
+	u64 start_retries; // start triples rolled again for being unusable
+	u64 generate_ns;
+	u64 rolls_hist[METRIC_ROLL_BUCKETS];
+	u64 length_hist[LTR_NAME_MAX];
+} gen_metrics;
+
+#ifdef LTR_METRICS
+static const char* const metric_phase_names[METRIC_PHASES] = { "decode", "fix", "analyze", "build", "compiled", "generate" };
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+#define METRICS_LOCK() pthread_mutex_lock(&metrics_lock)
+#define METRICS_UNLOCK() pthread_mutex_unlock(&metrics_lock)
+#else
+#define METRICS_LOCK()
+#define METRICS_UNLOCK()
+#endif
+
+static struct
+{
+	ltr_gen_stats stats;
+	gen_metrics gen;
+	u64 generators;
+	u64 phase_ns[METRIC_PHASES];
+	u64 phase_count[METRIC_PHASES];
+} metrics;
+
+// add the time since start to a load phase
+static void metrics_phase(u32 phase, u64 start)
+{
+	u64 ns = ltr_clock_ns() - start;
+	METRICS_LOCK();
+	metrics.phase_ns[phase] += ns;
+	metrics.phase_count[phase]++;
+	METRICS_UNLOCK();
+}
+
+// record a finished name: how many draws it took since starting at pos, and its length
+static void metrics_name(gen_metrics* m, u64 draws, u32 len)
+{
+	u32 b = 0;
+	while ((b < (METRIC_ROLL_BUCKETS - 1)) && (draws > (1ULL << b)))
+		b++;
+	m->rolls += draws;
+	m->rolls_hist[b]++;
+	m->length_hist[(len < LTR_NAME_MAX) ? len : (LTR_NAME_MAX - 1)]++;
+}
+
+static void metrics_add(gen_metrics* to, const gen_metrics* from)
+{
+	to->rolls += from->rolls;
+	to->start_retries += from->start_retries;
+	to->generate_ns += from->generate_ns;
+	for (u32 b = 0; b < METRIC_ROLL_BUCKETS; b++)
+		to->rolls_hist[b] += from->rolls_hist[b];
+	for (u32 n = 0; n < LTR_NAME_MAX; n++)
+		to->length_hist[n] += from->length_hist[n];
+}
+#endif
+
+bool ltr_metrics_enabled(void)
+{
+#ifdef LTR_METRICS
+	return true;
+#else
+	return false;
+#endif
+}
+
+void ltr_metrics_reset(void)
+{
+#ifdef LTR_METRICS
+	METRICS_LOCK();
+	memset(&metrics, 0, sizeof(metrics));
+	METRICS_UNLOCK();
+#endif
+}
+
+#ifdef LTR_METRICS
+// one histogram, as a JSON array of bucket counts or as a Prometheus
+// histogram with cumulative buckets; bucket b holds values up to limit(b)
+static void metrics_write_hist(FILE* out, u32 format, const char* name, const char* help, const u64* hist, u32 buckets, u64 (*limit)(u32), u64 sum)
+{
+	if (format == LTR_METRICS_JSON)
+	{
+		fprintf(out, ",\n  \"%s\": { \"le\": [", name);
+		for (u32 b = 0; b < buckets - 1; b++)
+			fprintf(out, "%s%llu", b ? ", " : "", (unsigned long long)limit(b));
+		fprintf(out, "], \"counts\": [");
+		for (u32 b = 0; b < buckets; b++)
+			fprintf(out, "%s%llu", b ? ", " : "", (unsigned long long)hist[b]);
+		fprintf(out, "], \"sum\": %llu }", (unsigned long long)sum);
+		return;
+	}
+	u64 total = 0;
+	fprintf(out, "# HELP ltr_%s %s\n# TYPE ltr_%s histogram\n", name, help, name);
+	for (u32 b = 0; b < buckets - 1; b++)
+	{
+		total += hist[b];
+		fprintf(out, "ltr_%s_bucket{le=\"%llu\"} %llu\n", name, (unsigned long long)limit(b), (unsigned long long)total);
+	}
+	total += hist[buckets - 1];
+	fprintf(out, "ltr_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)total);
+	fprintf(out, "ltr_%s_sum %llu\nltr_%s_count %llu\n", name, (unsigned long long)sum, name, (unsigned long long)total);
+}
+
+static u64 roll_limit(u32 b)
+{
+	return 1ULL << b;
+}
+
+static u64 length_limit(u32 b)
+{
+	return b;
+}
+#endif
+
+// write the process totals as JSON (LTR_METRICS_JSON) or in the Prometheus
+// text format (LTR_METRICS_PROM). Generators still in use aren't included.
+bool ltr_metrics_write(FILE* out, u32 format)
+{
+#ifdef LTR_METRICS
+	METRICS_LOCK();
+	ltr_gen_stats st = metrics.stats;
+	gen_metrics m = metrics.gen;
+	u64 generators = metrics.generators;
+	u64 phase_ns[METRIC_PHASES], phase_count[METRIC_PHASES];
+	memcpy(phase_ns, metrics.phase_ns, sizeof(phase_ns));
+	memcpy(phase_count, metrics.phase_count, sizeof(phase_count));
+	METRICS_UNLOCK();
+	phase_ns[METRIC_GENERATE] = m.generate_ns;
+	phase_count[METRIC_GENERATE] = generators;
+	const struct { const char* name; const char* help; u64 value; } counters[] =
+	{
+		{ "generators", "generators freed", generators },
+		{ "names", "names generated", st.names },
+		{ "rolls", "rng draws taken by names", m.rolls },
+		{ "backtracks", "letters taken back after a failed roll", st.backtracks },
+		{ "restarts", "names given up on and started over", st.restarts },
+		{ "start_retries", "start triples rolled again for being unusable", m.start_retries },
+		{ "pruned", "picks rolled again for leading into a dead end", st.pruned },
+		{ "forced_ends", "names ended because they could not go on", st.forced_ends },
+		{ "duplicates", "names thrown away as duplicates", st.duplicates },
+		{ "excluded", "names thrown away by the exclusion filter", st.excluded },
+	};
+	u64 length_sum = 0;
+	for (u32 n = 0; n < LTR_NAME_MAX; n++)
+		length_sum += n * m.length_hist[n];
+	if (format == LTR_METRICS_JSON)
+	{
+		fprintf(out, "{\n  \"enabled\": true");
+		for (u32 i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+			fprintf(out, ",\n  \"%s\": %llu", counters[i].name, (unsigned long long)counters[i].value);
+		fprintf(out, ",\n  \"phases\": {");
+		for (u32 p = 0; p < METRIC_PHASES; p++)
+			fprintf(out, "%s\n    \"%s\": { \"count\": %llu, \"ns\": %llu }", p ? "," : "", metric_phase_names[p], (unsigned long long)phase_count[p], (unsigned long long)phase_ns[p]);
+		fprintf(out, "\n  }");
+	}
+	else
+	{
+		for (u32 i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+			fprintf(out, "# HELP ltr_%s_total %s\n# TYPE ltr_%s_total counter\nltr_%s_total %llu\n", counters[i].name, counters[i].help, counters[i].name, counters[i].name, (unsigned long long)counters[i].value);
+		fprintf(out, "# HELP ltr_phase_seconds_total time spent in each phase of loading and generating\n# TYPE ltr_phase_seconds_total counter\n");
+		for (u32 p = 0; p < METRIC_PHASES; p++)
+			fprintf(out, "ltr_phase_seconds_total{phase=\"%s\"} %.9f\n", metric_phase_names[p], phase_ns[p] / 1e9);
+		fprintf(out, "# HELP ltr_phase_runs_total times each phase of loading and generating ran\n# TYPE ltr_phase_runs_total counter\n");
+		for (u32 p = 0; p < METRIC_PHASES; p++)
+			fprintf(out, "ltr_phase_runs_total{phase=\"%s\"} %llu\n", metric_phase_names[p], (unsigned long long)phase_count[p]);
+	}
+	metrics_write_hist(out, format, "rolls_per_name", "rng draws taken by each name", m.rolls_hist, METRIC_ROLL_BUCKETS, roll_limit, m.rolls);
+	metrics_write_hist(out, format, "name_length", "letters in each name", m.length_hist, LTR_NAME_MAX, length_limit, length_sum);
+	if (format == LTR_METRICS_JSON)
+		fprintf(out, "\n}\n");
+#else
+	if (format == LTR_METRICS_JSON)
+		fprintf(out, "{\n  \"enabled\": false\n}\n");
+	else
+		fprintf(out, "# metrics are not built in; build with LTR_METRICS defined\n");
+#endif
+	return !ferror(out);
+}
+
+/* tracing
+ *
+ * tprintf is eprintf for the diagnostics that come thick and fast: every
+ * letter generated and every guess of the analysis. Until ltr_trace_start
+ * is called it prints and flushes the same way. After that it only records
+ * the format and the raw arguments in the calling thread's ring, and the
+ * text is put together later, by trace_drain: from a background thread, or
+ * from ltr_trace_flush, at exit, and on a crash. A ring belongs to one
+ * thread at a time, and passes to a new thread when its owner exits, so the
+ * short lived threads of batch generation don't each cost a ring. With the
+ * background drainer running, a thread whose ring is full waits for it, so
+ * nothing is lost; without it, the rings only keep the newest records, and
+ * the trace says how many were lost.
+ */
+#define TRACE_DATA   (112) // bytes of arguments a record holds; long strings are cut short
+#define TRACE_FLAGS  "-+ #0123456789."
+#define TRACE_WAIT   (1000) // us the background drainer sleeps once there is nothing to drain
+#define TRACE_PAUSE  (50) // us a thread with a full ring sleeps while waiting for the drainer
+#define TRACE_LINE   (1024) // longest record text; longer ones are cut short
+
+typedef struct trace_rec
+{
+	const char* fmt; // always a string literal, so it outlives the record
+	u64 ns;
+	u8 data[TRACE_DATA];
+} trace_rec;
+
+typedef struct trace_ring
+{
+	trace_rec* recs;
+	u64 mask;
+	u64 head; // records written; only the owner changes it
+	u64 tail; // records drained; only trace_drain changes it
+	u64 drained; // records drained by the latest trace_drain
+	bool owned;
+	struct trace_ring* next;
+} trace_ring;
+
+static struct
+{
+	volatile bool active;
+	FILE* out;
+	int fd; // out's descriptor, for writing without stdio on a crash
+	u32 ring_records;
+	trace_ring* rings;
+	u64 dropped;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock; // guards the list of rings, their ownership and draining
+	pthread_key_t key; // the calling thread's ring
+	bool key_made;
+	pthread_t drainer;
+	bool draining;
+	volatile bool stop;
+#else
+	trace_ring* mine;
+#endif
+	bool handlers;
+} trace = {
+	.active = false,
+#ifdef HAVE_PTHREAD
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+#define tprintf(v, ...) \
+	do { if (v) { if (trace.active) trace_record(__VA_ARGS__); else { fprintf(stderr, __VA_ARGS__); fflush(stderr); } } } while (0)
+
+#ifdef HAVE_PTHREAD
+// a thread holding a ring has exited; the next thread to need one may take it
+static void trace_release(void* arg)
+{
+	trace_ring* r = arg;
+	pthread_mutex_lock(&trace.lock);
+	r->owned = false;
+	pthread_mutex_unlock(&trace.lock);
+}
+#endif
+
+// the calling thread's ring, taking a free one or making one if need be
+static trace_ring* trace_ring_mine(void)
+{
+#ifdef HAVE_PTHREAD
+	trace_ring* r = pthread_getspecific(trace.key);
+	if (r)
+		return r;
+	pthread_mutex_lock(&trace.lock);
+#else
+	trace_ring* r = trace.mine;
+	if (r)
+		return r;
+#endif
+	for (r = trace.rings; r && r->owned; r = r->next)
+		;
+	if (r == NULL)
+	{
+		r = calloc(1, sizeof(trace_ring));
+		if (r)
+			r->recs = malloc((size_t)trace.ring_records * sizeof(trace_rec));
+		if (r && r->recs)
+		{
+			r->mask = trace.ring_records - 1;
+			r->next = trace.rings;
+			trace.rings = r;
+		}
+		else
+		{
+			free(r);
+			r = NULL;
+		}
+	}
+	if (r)
+		r->owned = true;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&trace.lock);
+	if (r)
+		pthread_setspecific(trace.key, r);
+#else
+	trace.mine = r;
+#endif
+	return r;
+}
+
+// the length modifier and conversion of the specification after a %
+typedef struct trace_conv
+{
+	u32 longs; // number of l's
+	bool size; // z
+	char conv;
+	const char* end; // the conversion character
+} trace_conv;
+
+static trace_conv trace_parse(const char* p)
+{
+	trace_conv v = { 0, false, '\0', NULL };
+	p += strspn(p, TRACE_FLAGS);
+	for (; *p == 'l'; p++)
+		v.longs++;
+	if (*p == 'z')
+	{
+		v.size = true;
+		p++;
+	}
+	v.conv = *p;
+	v.end = p;
+	return v;
+}
+
+static void trace_record(const char* fmt, ...)
+{
+	trace_ring* r = trace_ring_mine();
+	if (r == NULL)
+		return;
+#ifdef HAVE_PTHREAD
+	while (trace.draining && ((r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) > r->mask))
+	{
+		struct timespec ts = { 0, TRACE_PAUSE * 1000L };
+		nanosleep(&ts, NULL);
+	}
+#endif
+	trace_rec* t = &r->recs[r->head & r->mask];
+	u8* d = t->data;
+	u8* end = t->data + TRACE_DATA;
+	t->fmt = fmt;
+	t->ns = ltr_clock_ns();
+	va_list ap;
+	va_start(ap, fmt);
+	for (const char* p = strchr(fmt, '%'); p; p = strchr(p + 1, '%'))
+	{
+		trace_conv v = trace_parse(p + 1);
+		p = v.end;
+		if (v.conv == '\0')
+			break;
+		if (v.conv == '%')
+			continue;
+		if (v.conv == 's')
+		{
+			const char* s = va_arg(ap, const char*);
+			size_t n = strlen(s);
+			if (n > (size_t)(end - d) - 1)
+				n = (end - d) - 1;
+			memcpy(d, s, n);
+			d[n] = '\0';
+			d += n + 1;
+			continue;
+		}
+		u64 x;
+		if ((v.conv == 'f') || (v.conv == 'g') || (v.conv == 'e'))
+		{
+			double f = va_arg(ap, double);
+			memcpy(&x, &f, sizeof(x));
+		}
+		else if (v.size)
+			x = va_arg(ap, size_t);
+		else if (v.longs >= 2)
+			x = va_arg(ap, unsigned long long);
+		else if (v.longs)
+			x = va_arg(ap, unsigned long);
+		else if (v.conv == 'p')
+			x = (uintptr_t)va_arg(ap, void*);
+		else
+			x = va_arg(ap, unsigned int);
+		memcpy(d, &x, sizeof(x));
+		d += sizeof(x);
+		if (end - d < (ptrdiff_t)sizeof(x))
+			break; // no room for more; trace_format stops at the same place
+	}
+	va_end(ap);
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+// put a record into buf as tprintf would have printed it straight away,
+// cutting it short if it doesn't fit; returns the length. Nothing here takes
+// the stdio locks, so a crash can use it too.
+static size_t trace_format(char* buf, size_t size, const trace_rec* t)
+{
+	const u8* d = t->data;
+	const u8* end = t->data + TRACE_DATA;
+	const char* p = t->fmt;
+	size_t len = 0;
+#define TRACE_TEXT(s, n) \
+	do { size_t m = (size_t)(n); if (m > size - 1 - len) m = size - 1 - len; memcpy(buf + len, s, m); len += m; } while (0)
+#define TRACE_PUT(...) \
+	do { int w = snprintf(buf + len, size - len, __VA_ARGS__); if (w > 0) len += ((size_t)w < size - len) ? (size_t)w : size - 1 - len; } while (0)
+	for (const char* pc = strchr(p, '%'); pc; pc = strchr(p, '%'))
+	{
+		TRACE_TEXT(p, pc - p);
+		trace_conv v = trace_parse(pc + 1);
+		if ((v.conv == '\0') || ((v.conv != '%') && (end - d < (ptrdiff_t)((v.conv == 's') ? 1 : sizeof(u64)))))
+			return len;
+		char spec[32];
+		size_t n = (v.end + 1) - pc;
+		if (n >= sizeof(spec))
+			return len;
+		memcpy(spec, pc, n);
+		spec[n] = '\0';
+		p = v.end + 1;
+		if (v.conv == '%')
+		{
+			TRACE_TEXT("%", 1);
+			continue;
+		}
+		if (v.conv == 's')
+		{
+			size_t slen = strnlen((const char*)d, end - d - 1);
+			char s[TRACE_DATA];
+			memcpy(s, d, slen);
+			s[slen] = '\0';
+			TRACE_PUT(spec, s);
+			d += slen + 1;
+			continue;
+		}
+		u64 x;
+		memcpy(&x, d, sizeof(x));
+		d += sizeof(x);
+		if ((v.conv == 'f') || (v.conv == 'g') || (v.conv == 'e'))
+		{
+			double f;
+			memcpy(&f, &x, sizeof(f));
+			TRACE_PUT(spec, f);
+		}
+		else if (v.size)
+			TRACE_PUT(spec, (size_t)x);
+		else if (v.longs >= 2)
+			TRACE_PUT(spec, (unsigned long long)x);
+		else if (v.longs)
+			TRACE_PUT(spec, (unsigned long)x);
+		else if (v.conv == 'p')
+			TRACE_PUT(spec, (void*)(uintptr_t)x);
+		else
+			TRACE_PUT(spec, (unsigned int)x);
+	}
+	TRACE_TEXT(p, strlen(p));
+#undef TRACE_TEXT
+#undef TRACE_PUT
+	buf[len] = '\0';
+	return len;
+}
+
+// send formatted text to the trace output; a crash goes around stdio, whose
+// locks and buffers the crashed thread may have been in the middle of
+static void trace_emit(const char* buf, size_t len, bool crash)
+{
+#ifdef HAVE_MMAP
+	if (crash)
+	{
+		while (len)
+		{
+			ssize_t w = write(trace.fd, buf, len);
+			if (w <= 0)
+				return;
+			buf += w;
+			len -= w;
+		}
+		return;
+	}
+#else
+	(void)crash;
+#endif
+	fwrite(buf, 1, len, trace.out);
+}
+
+// copy the next record of a ring, if it has one that hasn't been overwritten
+// since; skipped records are counted as dropped
+static bool trace_next(trace_ring* r, trace_rec* t)
+{
+	for (;;)
+	{
+		u64 head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (r->tail == head)
+			return false;
+		if (head - r->tail > r->mask + 1)
+		{
+			trace.dropped += (head - r->tail) - (r->mask + 1);
+			r->tail = head - (r->mask + 1);
+		}
+		*t = r->recs[r->tail & r->mask];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		u64 copied = r->tail;
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&r->tail, copied + 1, __ATOMIC_RELEASE);
+		if (trace.draining || (head - copied <= r->mask)) // not overwritten while copying; with the drainer, it can't have been
+		{
+			r->drained++;
+			return true;
+		}
+		trace.dropped++;
+	}
+}
+
+// format everything recorded so far, oldest first across all the rings.
+// Called with the lock held, which a crash takes with a trylock.
+static void trace_drain(bool crash)
+{
+	u32 num_rings = 0;
+	for (trace_ring* r = trace.rings; r; r = r->next)
+		num_rings++;
+	if (!num_rings || (trace.out == NULL))
+		return;
+	trace_ring* rings[num_rings];
+	trace_rec next[num_rings];
+	bool have[num_rings];
+	u64 dropped = trace.dropped;
+	u32 n = 0;
+	for (trace_ring* r = trace.rings; r; r = r->next, n++)
+	{
+		r->drained = 0;
+		rings[n] = r;
+		have[n] = trace_next(r, &next[n]);
+	}
+	for (;;)
+	{
+		s32 first = -1;
+		for (u32 i = 0; i < num_rings; i++)
+		{
+			if (have[i] && ((first < 0) || (next[i].ns < next[first].ns)))
+				first = i;
+		}
+		if (first < 0)
+			break;
+		char line[TRACE_LINE];
+		size_t len = trace_format(line, sizeof(line), &next[first]);
+		trace_emit(line, len, crash);
+		have[first] = trace_next(rings[first], &next[first]);
+	}
+	if (trace.dropped != dropped)
+	{
+		char line[TRACE_LINE];
+		int len = snprintf(line, sizeof(line), "W* trace lost %llu records; use bigger rings or the background drainer\n", (unsigned long long)(trace.dropped - dropped));
+		trace_emit(line, len, crash);
+	}
+	if (!crash)
+		fflush(trace.out);
+}
+
+#ifdef HAVE_PTHREAD
+static void* trace_drainer(void* arg)
+{
+	(void)arg;
+	while (!trace.stop)
+	{
+		u64 drained = 0;
+		pthread_mutex_lock(&trace.lock);
+		trace_drain(false);
+		for (trace_ring* r = trace.rings; r; r = r->next)
+			drained += r->drained;
+		pthread_mutex_unlock(&trace.lock);
+		if (!drained)
+		{
+			struct timespec ts = { 0, TRACE_WAIT * 1000L };
+			nanosleep(&ts, NULL);
+		}
+	}
+	return NULL;
+}
+#endif
+
+void ltr_trace_flush(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&trace.lock);
+	trace_drain(false);
+	pthread_mutex_unlock(&trace.lock);
+#else
+	trace_drain(false);
+#endif
+}
+
+#ifdef HAVE_MMAP
+// on a crash, write out what the rings hold before dying the usual way; a
+// best effort, as a crashed process can't promise anything. If a drain was
+// already under way the rings can't be walked safely, so only say so.
+static void trace_crash(int sig)
+{
+#ifdef HAVE_PTHREAD
+	if (pthread_mutex_trylock(&trace.lock))
+	{
+		static const char busy[] = "W* crashed while the trace was being written; the rest of it is lost\n";
+		trace_emit(busy, sizeof(busy) - 1, true);
+		signal(sig, SIG_DFL);
+		raise(sig);
+		return;
+	}
+#endif
+	trace_drain(true);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+#endif
+
+void ltr_trace_stop(void)
+{
+	if (!trace.active)
+		return;
+#ifdef HAVE_PTHREAD
+	if (trace.draining)
+	{
+		trace.stop = true;
+		pthread_join(trace.drainer, NULL);
+		trace.draining = false;
+	}
+#endif
+	ltr_trace_flush();
+	trace.active = false;
+}
+
+static void trace_atexit(void)
+{
+	ltr_trace_stop();
+}
+
+// start recording diagnostics into rings of ring_records records (a power of
+// two) per thread, to be written to out by a background thread, or if
+// background is false, by ltr_trace_flush, ltr_trace_stop, exit or a crash.
+// The rings are kept until the process exits, and only one trace can run at
+// a time.
+int ltr_trace_start(FILE* out, u32 ring_records, bool background)
+{
+	if (trace.active || !ring_records || (ring_records & (ring_records - 1)))
+		return LTR_E_PARAM;
+	if (trace.rings && (ring_records != trace.ring_records))
+		return LTR_E_PARAM; // existing rings are sized for the first trace
+	trace.out = out;
+#ifdef HAVE_MMAP
+	trace.fd = fileno(out);
+#endif
+	trace.ring_records = ring_records;
+	trace.dropped = 0;
+#ifdef HAVE_PTHREAD
+	if (!trace.key_made)
+	{
+		if (pthread_key_create(&trace.key, trace_release))
+			return LTR_E_ALLOC;
+		trace.key_made = true;
+	}
+	trace.stop = false;
+	if (background)
+		trace.draining = !pthread_create(&trace.drainer, NULL, trace_drainer, NULL);
+#else
+	(void)background;
+#endif
+	if (!trace.handlers)
+	{
+		atexit(trace_atexit);
+#ifdef HAVE_MMAP
+		signal(SIGSEGV, trace_crash);
+		signal(SIGBUS, trace_crash);
+		signal(SIGFPE, trace_crash);
+		signal(SIGILL, trace_crash);
+		signal(SIGABRT, trace_crash);
+#endif
+		trace.handlers = true;
+	}
+	trace.active = true;
+	return LTR_OK;
+}
+
+// struct definitions
+typedef struct f_array
+{
+	s32 count; // this is the number of this specific letter used in this table, the numerator for each letter
+	float cdf_data;
+	float pdf_data;
+} f_array;
+
+typedef struct cdf_array
+{
+	// these are the number of letters with non-zero counts within each of the tables
+	s32 start_buckets;
+	s32 middle_buckets;
+	s32 end_buckets;
+	// these are the total counts for number of letters used to generate the 3 cdf tables, the common denominator for all letters within each array
+	s32 start_total;
+	s32 middle_total;
+	s32 end_total;
+} cdf_array;
+
+typedef struct alias_entry
+{
+	u32 prob; // out of ALIAS_ONE; rolls below this pick this entry's own letter
+	u8 alias; // letter picked otherwise, or num_letters if the row is empty
+} alias_entry;
+
+#define ALIAS_BITS (30)
+#define ALIAS_ONE  (1 << ALIAS_BITS)
+
+// Every roll used for a cdf lookup is one of only MSRAND_MAX+1 values, so
+// each row can be compiled into the exact roll -> letter mapping. The mapping
+// is a step function: thresh[i] is the first roll that no longer picks any of
+// letters 0..i, and base[] caches the letter picked by the first roll of each
+// bucket so that at most a step or two is needed from there.
+#define LUT_SHIFT   (9)
+#define LUT_BUCKETS ((0x7fff >> LUT_SHIFT) + 1)
+// packed copies of every row's cdf_data for the vectorized cdf search; rows
+// are padded with zeroes, which no roll can be below.
+#define CDF_STRIDE (32)
+
+typedef struct lut_row
+{
+	u16 thresh[28+1]; // one extra entry as a sentinel that no roll can reach
+	u8 base[LUT_BUCKETS];
+} lut_row;
+
+struct ltrfile
+{
+	char magic[8];
+	u8 num_letters;
+	ltr_opts opts; // what the model was loaded with
+	cdf_array* tables; // bucket and total counts for each table, LTR_NUM_TABLES(num_letters) entries
+	u16* row_of; // stored row of each table's start, middle and end rows
+	u32 num_rows; // rows stored; row 0 is shared by every empty row
+	f_array* rows; // the stored rows, num_letters entries per row
+	alias_entry* alias; // alias tables laid out like rows, or NULL if not built
+	lut_row* lut; // roll lookup tables, one per stored row, or NULL if not built
+	float* cdf; // packed cdf_data, CDF_STRIDE entries per stored row, or NULL if not built
+	u32* sparse; // (thresh << 8) | letter for each letter a stored row can pick, or NULL if not built
+	u32* cum; // running totals of each stored row's counts, COUNT_STRIDE entries per row, or NULL if not built
+	u32* sparse_start; // where each stored row's entries start in sparse, num_rows + 1 entries
+	u32 num_sparse; // entries in sparse
+	u8* reach; // fewest letters that can still end a name from each (i, j) letter pair state, or NULL if not built
+	u8* reach_middle; // the same, going on through the middle row; shares reach's allocation
+	u64 hash; // ltr_hash of the .ltr image the model was loaded from
+	const u8* image; // compiled model all of the tables point into, or NULL if they were allocated
+	size_t image_len;
+};
+
+// All of the tables live in a single arena allocated together with the
+// ltrfile itself, in the same order they appear in the .ltr file: singles,
+// then doubles[j], then triples[k][j]; each table holds a start, a middle and
+// an end row of num_letters entries. Tables and rows are addressed by computed
+// offsets rather than by following pointers.
+#define LTR_NUM_TABLES(n)  (1 + (u32)(n) + ((u32)(n) * (n)))
+#define LTR_SINGLES        (0)
+#define LTR_DOUBLES(l,j)   (1 + (j))
+#define LTR_TRIPLES(l,k,j) (1 + (l)->num_letters + ((k) * (l)->num_letters) + (j))
+#define ROW_START  (0)
+#define ROW_MIDDLE (1)
+#define ROW_END    (2)
+#define LTR_CDF(l,t)       ((l)->tables + (t))
+#define LTR_ROW_INDEX(l,t,r) ((l)->row_of[((t) * 3) + (r)])
+#define LTR_ROW(l,t,r)     ((l)->rows + (LTR_ROW_INDEX(l,t,r) * (l)->num_letters))
+#define LTR_STATE(l,i,j)   (((i) * (l)->num_letters) + (j))
+// reach of a state that can't end a name within LTR_NAME_MAX - 1 letters
+#define REACH_NEVER (0xff)
+
+/* gcd */
+u32 gcd(u32 a, u32 b)
+{
+	while (b)
+	{
+		a %= b;
+		// clever way to do a swap(a,b) with no other variable/register:
+		a ^= b;
+		b ^= a;
+		a ^= b;
+	}
+	return a;
+}
+
+/* lcm */
+u32 lcm(u32 a, u32 b)
+{
+	return abs(a*b)/gcd(a,b);
+}
+
+/* msrand implementation for consistency */
+#define MSRAND_MUL 214013
+#define MSRAND_ADD 2531011
+#define MSRAND_MASK 0x7fffffff
+
+u32 ms_rand(ms_rng* r)
+{
+	r->state = ((r->state * MSRAND_MUL) + MSRAND_ADD) & MSRAND_MASK;
+	r->pos++;
+	return (r->state >> 16) & 0x7fff;
+}
+
+void ms_srand(ms_rng* r, u32 seed)
+{
+	r->state = seed;
+	r->pos = 0;
+}
+
+// the state only has 31 bits, so the sequence repeats every 2^31 draws
+#define MSRAND_PERIOD (((u64)MSRAND_MASK) + 1)
+
+// the LCG step x -> (a*x + c) composed with itself n times, in O(log n);
+// everything is mod 2^31, so plain u32 math works
+static void ms_compose(u64 n, u32* mul_out, u32* add_out)
+{
+	u32 acc_mul = 1, acc_add = 0;
+	u32 mul = MSRAND_MUL, add = MSRAND_ADD;
+	n %= MSRAND_PERIOD;
+	while (n)
+	{
+		if (n & 1)
+		{
+			acc_mul = acc_mul * mul;
+			acc_add = (acc_add * mul) + add;
+		}
+		add = (mul + 1) * add;
+		mul = mul * mul;
+		n >>= 1;
+	}
+	*mul_out = acc_mul;
+	*add_out = acc_add;
+}
+
+// advance a raw state by n draws
+static u32 ms_advance(u32 state, u64 n)
+{
+	u32 mul, add;
+	ms_compose(n, &mul, &add);
+	return ((state * mul) + add) & MSRAND_MASK;
+}
+
+// advance the generator by n draws
+void ms_skip(ms_rng* r, u64 n)
+{
+	r->state = ms_advance(r->state, n);
+	r->pos += n;
+}
+
+// rewind the generator by n draws; going back by n is the same as going
+// forward by the rest of the period. Rewinding past the seed wraps pos.
+void ms_rewind(ms_rng* r, u64 n)
+{
+	r->state = ms_advance(r->state, MSRAND_PERIOD - (n % MSRAND_PERIOD));
+	r->pos -= n;
+}
+
+// move the generator forward (n > 0) or backward (n < 0) by n draws
+void ms_jump(ms_rng* r, s64 n)
+{
+	if (n >= 0)
+		ms_skip(r, n);
+	else
+		ms_rewind(r, -(u64)n);
+}
+
+// Lanes: each draw depends on the one before, so drawing one at a time is a
+// single serial chain. Instead, MSRAND_LANES copies of the LCG are started
+// one draw apart and each stepped MSRAND_LANES draws at a time; between them
+// they still give every state of the stream in order, exactly as ms_rand
+// would, but the lanes don't wait on each other and are stepped together in
+// vector registers where the cpu allows. So lane l of an rng seeded with
+// s is s advanced by l + 1 draws, and nothing changes for a given seed.
+#define MSRAND_LANES (16)
+
+// step every lane by MSRAND_LANES draws, steps times, writing out each
+// lane's state before each step
+typedef void (*ms_lanes_fn)(u32* lanes, u32* out, u32 steps, u32 mul, u32 add);
+
+static void ms_lanes_scalar(u32* lanes, u32* out, u32 steps, u32 mul, u32 add)
+{
+	for (u32 s = 0; s < steps; s++, out += MSRAND_LANES)
+	{
+		for (u32 i = 0; i < MSRAND_LANES; i++)
+		{
+			out[i] = lanes[i];
+			lanes[i] = ((lanes[i] * mul) + add) & MSRAND_MASK;
+		}
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void ms_lanes_avx2(u32* lanes, u32* out, u32 steps, u32 mul, u32 add)
+{
+	__m256i m = _mm256_set1_epi32(mul);
+	__m256i a = _mm256_set1_epi32(add);
+	__m256i mask = _mm256_set1_epi32(MSRAND_MASK);
+	__m256i lo = _mm256_loadu_si256((const __m256i*)lanes);
+	__m256i hi = _mm256_loadu_si256((const __m256i*)(lanes + 8));
+	for (u32 s = 0; s < steps; s++, out += MSRAND_LANES)
+	{
+		_mm256_storeu_si256((__m256i*)out, lo);
+		_mm256_storeu_si256((__m256i*)(out + 8), hi);
+		lo = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(lo, m), a), mask);
+		hi = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(hi, m), a), mask);
+	}
+	_mm256_storeu_si256((__m256i*)lanes, lo);
+	_mm256_storeu_si256((__m256i*)(lanes + 8), hi);
+}
+#endif
+
+// picked along with the cdf search kernels
+static ms_lanes_fn ms_lanes = ms_lanes_scalar;
+void cdf_search_init(void);
+
+// write the n states following state to out, n a multiple of MSRAND_LANES
+static void ms_fill_states(u32 state, u32* out, u32 n)
+{
+	u32 lanes[MSRAND_LANES];
+	for (u32 i = 0; i < MSRAND_LANES; i++)
+		lanes[i] = state = ((state * MSRAND_MUL) + MSRAND_ADD) & MSRAND_MASK;
+	u32 mul, add;
+	ms_compose(MSRAND_LANES, &mul, &add);
+	cdf_search_init();
+	ms_lanes(lanes, out, n / MSRAND_LANES, mul, add);
+}
+
+// draw n values at once; the same as n calls of ms_rand
+void ms_fill(ms_rng* r, u32* out, u32 n)
+{
+	u32 whole = n - (n % MSRAND_LANES);
+	if (whole)
+	{
+		ms_fill_states(r->state, out, whole);
+		r->state = out[whole - 1];
+		r->pos += whole;
+		for (u32 i = 0; i < whole; i++)
+			out[i] = (out[i] >> 16) & 0x7fff;
+	}
+	for (u32 i = whole; i < n; i++)
+		out[i] = ms_rand(r);
+}
+
+// write and read an ms_rng as a one-line text checkpoint, so a long run can
+// be resumed, or split across processes, without replaying it.
+#define MSRAND_CHECKPOINT "msrand"
+
+bool ms_rng_save(const ms_rng* r, FILE* out)
+{
+	return fprintf(out, MSRAND_CHECKPOINT " %u %llu\n", r->state, (unsigned long long)r->pos) > 0;
+}
+
+bool ms_rng_restore(ms_rng* r, FILE* in)
+{
+	u32 state;
+	unsigned long long pos;
+	if (fscanf(in, MSRAND_CHECKPOINT " %u %llu", &state, &pos) != 2)
+		return false;
+	r->state = state;
+	r->pos = pos;
+	return true;
+}
+
+/* end msrand */
+
+// .ltr floats are always stored little endian; assembling them bytewise lets
+// the compiler emit a plain load on little endian hosts with no runtime check
+static float get_f(const u8* p)
+{
+	u32 t = ((u32)p[0]) | ((u32)p[1]<<8) | ((u32)p[2]<<16) | ((u32)p[3]<<24);
+	float f;
+	memcpy(&f, &t, sizeof(f));
+	return f;
+}
+
+const char* ltr_strerror(int err)
+{
+	switch (err)
+	{
+		case LTR_OK: return "no error";
+		case LTR_E_OPEN: return "unable to open input file";
+		case LTR_E_SIZE: return "input size is invalid";
+		case LTR_E_MAGIC: return "incorrect magic number";
+		case LTR_E_LETTERS: return "invalid number of letters";
+		case LTR_E_TRUNCATED: return "input is truncated";
+		case LTR_E_ALLOC: return "out of memory";
+		case LTR_E_PARAM: return "invalid option";
+		case LTR_E_WRITE: return "unable to write output file";
+		case LTR_E_STALE: return "compiled model or counts file is out of date";
+		case LTR_E_DEAD: return "model can't produce any name";
+		case LTR_E_NOMODEL: return "no such model";
+		case LTR_E_COUNTS: return "the model's counts couldn't be recovered";
+		default: return "unknown error";
+	}
+}
+
+// allocate an ltrfile along with the arena holding all of its tables, in one
+// block. Only num_rows rows are stored, and row 0 is left empty for sharing.
+ltrfile* ltr_alloc(u8 num_letters, u32 num_rows)
+{
+	u32 num_tables = LTR_NUM_TABLES(num_letters);
+	size_t size = sizeof(ltrfile) + (num_tables * sizeof(cdf_array)) + (num_rows * num_letters * sizeof(f_array)) + (num_tables * 3 * sizeof(u16));
+	ltrfile *l = malloc(size);
+	if (l == NULL)
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for tables of size %zu, aborting!\n", size);
+		return NULL;
+	}
+	l->num_letters = num_letters;
+	l->num_rows = num_rows;
+	l->alias = NULL;
+	l->lut = NULL;
+	l->cdf = NULL;
+	l->sparse = NULL;
+	l->sparse_start = NULL;
+	l->cum = NULL;
+	l->num_sparse = 0;
+	l->reach = l->reach_middle = NULL;
+	l->image = NULL;
+	l->tables = (cdf_array*)(l + 1);
+	l->rows = (f_array*)(l->tables + num_tables);
+	l->row_of = (u16*)(l->rows + (num_rows * num_letters));
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		l->rows[i].count = 0;
+		l->rows[i].cdf_data = l->rows[i].pdf_data = 0.0;
+	}
+	for (u32 t = 0; t < num_tables; t++)
+	{
+		cdf_array *p = LTR_CDF(l, t);
+		p->start_buckets = p->middle_buckets = p->end_buckets = 0;
+		p->start_total = p->middle_total = p->end_total = 0;
+	}
+	return l;
+}
+
+// whether a row of num_letters floats in an .ltr image is all zero
+static bool row_is_empty(const u8* data, u8 num_letters)
+{
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		if (get_f(data + (i * sizeof(float))) != 0.0)
+			return false;
+	}
+	return true;
+}
+
+// decode an .ltr image from memory into a newly allocated ltrfile
+static int ltr_decode(const u8* data, u32 len, ltrfile** out, ltr_opts c)
+{
+	ltrfile *l = NULL;
+	u32 pos = 0;
+	*out = NULL;
+	// simple filesize sanity checks
+	if ((len < MINFILESIZE) || (len > MAXFILESIZE))
+	{
+		eprintf(V_ERR,"E* Input file size of %d is too %s!\n", len, (len < MINFILESIZE)?"small":"large");
+		return LTR_E_SIZE;
+	}
+	// magic
+	if (memcmp(data, "LTR V1.0", 8))
+	{
+		eprintf(V_ERR,"E* Incorrect magic number!\n");
+		return LTR_E_MAGIC;
+	}
+	pos += 8;
+	// number of letters
+	{ // scope-limit
+		u8 num_letters = data[pos++];
+		if ((num_letters < 1) || (num_letters > 28))
+		{
+			eprintf(V_ERR,"E* Invalid number of letters %d!\n", num_letters);
+			return LTR_E_LETTERS;
+		}
+		eprintf(V_LOAD,"D* LTR header read ok, num_letters = %d\n", num_letters);
+		u32 expected = pos + (LTR_NUM_TABLES(num_letters) * 3 * num_letters * sizeof(float));
+		if (len < expected)
+		{
+			eprintf(V_ERR,"E* Input file size of %d is too small for %d letters, expected %d!\n", len, num_letters, expected);
+			return LTR_E_TRUNCATED;
+		}
+		// most triples rows of a real file are empty, and all of those share
+		// one stored row; the singles rows are always stored, since fixing
+		// rewrites them
+		u32 num_rows = 1;
+		for (u32 r = 0; r < LTR_NUM_TABLES(num_letters) * 3; r++)
+		{
+			if ((r < 3) || !row_is_empty(data + pos + (r * num_letters * sizeof(float)), num_letters))
+				num_rows++;
+		}
+		l = ltr_alloc(num_letters, num_rows);
+		if (l == NULL)
+			return LTR_E_ALLOC;
+		l->opts = c;
+		l->hash = ltr_hash(data, len);
+		memcpy(l->magic, data, 8);
+		eprintf(V_LOAD2,"D* successfully allocated the cdf tables\n");
+	}
+
+#define LOAD_LTR_FLOATS(x) \
+	{ \
+		float acc = 0.0; \
+		for (u32 i = 0; i < l->num_letters; i++) \
+		{ \
+			x[i].cdf_data = get_f(data + pos); \
+			x[i].pdf_data = (x[i].cdf_data) ? (x[i].cdf_data - acc) : 0.0; \
+			x[i].count = -1; \
+			pos += 4; \
+			if (x[i].cdf_data) acc = x[i].cdf_data; \
+		} \
+	}
+
+	// There was a bug in the original code Bioware used to create .ltr files
+	// which caused the single.middle and single.end tables to have their CDF
+	// values corrupted for all entries past any which have a probability of
+	// zero. Fortunately, this can be corrected for in post, which we do here.
+
+	// If the final nonzero value in the table is not 'exactly' 1.0, then they
+	// are corrupt.
+	// Note that likely due to precision loss sometime during generation by
+	// Bioware's utility, the results, even after correction, may not exactly
+	// accumulate to 1.000000f, so we give a small bit of leeway.
+#define FIX_LTR_FLOATS(x) \
+	{ \
+		bool iscorrupt = true; \
+		for (u32 i = 0; i < l->num_letters; i++) \
+		{ \
+			if (fabs(x[i].cdf_data - 1.0) <= THRESH_MAXALLOWED) \
+				iscorrupt = false; \
+		} \
+		if (iscorrupt && c.fix) \
+		{ \
+			float acc = 0.0; \
+			float prev = 0.0; \
+			float correction = 0.0; \
+			float uncorrected = 0.0; \
+			eprintf(V_FIX,"Correcting errors in a probability table...\n"); \
+			for (u32 i = 0; i < l->num_letters; i++) \
+			{ \
+				uncorrected = x[i].cdf_data; \
+				if (x[i].cdf_data) \
+				{ \
+					if ((i > 0) && (prev == 0.0)) \
+						correction = acc; \
+					acc = x[i].cdf_data + correction; \
+					x[i].cdf_data = acc; \
+				} \
+				x[i].pdf_data = (x[i].cdf_data) ? (x[i].cdf_data - correction) : 0.0; \
+				x[i].count = -1; \
+				eprintf(V_FIX2,"ltr: %c, original: %f, corrected: %f, acc: %f, offset: %f\n", ltr_letters[i], uncorrected, x[i].cdf_data, acc, correction); \
+				prev = uncorrected; \
+			} \
+			if (fabs(acc - 1.0) > THRESH_MAXALLOWED) \
+				eprintf(V_FIX2,"*W during fixing process, accumulator ended up at a potentially incorrect value of %f!\n", acc); \
+		} \
+	}
+
+	// the stored rows are in file order, so every table is decoded in a single
+	// pass.
+	{ // scope-limit
+		u32 next = 1;
+		for (u32 t = 0; t < LTR_NUM_TABLES(l->num_letters); t++)
+		{
+			for (u32 r = 0; r < 3; r++)
+			{
+				if ((t != LTR_SINGLES) && row_is_empty(data + pos, l->num_letters))
+				{
+					LTR_ROW_INDEX(l, t, r) = 0;
+					pos += l->num_letters * sizeof(float);
+					continue;
+				}
+				LTR_ROW_INDEX(l, t, r) = next++;
+				LOAD_LTR_FLOATS(LTR_ROW(l, t, r));
+			}
+			eprintf(V_LOAD2,"D* successfully filled cdf table %d\n", t);
+		}
+	}
+	eprintf(V_LOAD,"D* all tables loaded, expected size was %d, final size was %d, %d of %d rows stored\n", len, pos, l->num_rows - 1, LTR_NUM_TABLES(l->num_letters) * 3);
+	*out = l;
+	return LTR_OK;
+}
+
+// only the singles middle and end rows can need fixing; this runs on the
+// decoded rows, so it is a pass of its own after ltr_decode.
+static void ltr_fix(ltrfile* l, ltr_opts c)
+{
+	FIX_LTR_FLOATS(LTR_ROW(l, LTR_SINGLES, ROW_MIDDLE));
+	FIX_LTR_FLOATS(LTR_ROW(l, LTR_SINGLES, ROW_END));
+}
+
+// map (or, failing that, read) a whole input file of min..max bytes; the
+// contents stay valid until input_release. Read-only mappings of the same
+// file share the page cache, so a model used in place from one costs no
+// private memory. An empty file, where min allows one, has nothing to map.
+static int input_open(const char* filename, ltr_opts c, size_t min, size_t max, const u8** data, size_t* len)
+{
+#ifdef HAVE_MMAP
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd < 0)
+	{
+		eprintf(V_ERR,"E* Unable to open input file %s!\n", filename);
+		return LTR_E_OPEN;
+	}
+	if (fstat(fd, &st) || (st.st_size < 0))
+	{
+		eprintf(V_ERR,"E* Unable to stat input file %s!\n", filename);
+		close(fd);
+		return LTR_E_OPEN;
+	}
+	if (((size_t)st.st_size < min) || ((size_t)st.st_size > max))
+	{
+		eprintf(V_ERR,"E* Input file size of %lld is too %s!\n", (long long)st.st_size, ((size_t)st.st_size < min)?"small":"large");
+		close(fd);
+		return LTR_E_SIZE;
+	}
+	if (st.st_size == 0)
+	{
+		close(fd);
+		*data = (const u8*)"";
+		*len = 0;
+		return LTR_OK;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		eprintf(V_ERR,"E* Unable to map input file %s!\n", filename);
+		return LTR_E_OPEN;
+	}
+	*data = map;
+	*len = st.st_size;
+#else
+	FILE *in = fopen(filename, "rb");
+	if (!in)
+	{
+		eprintf(V_ERR,"E* Unable to open input file %s!\n", filename);
+		return LTR_E_OPEN;
+	}
+	fseek(in, 0, SEEK_END);
+	long size = ftell(in);
+	rewind(in); //fseek(in, 0, SEEK_SET);
+	if ((size < 0) || ((size_t)size < min) || ((size_t)size > max))
+	{
+		eprintf(V_ERR,"E* Input file size of %ld is too %s!\n", size, ((size_t)size < min)?"small":"large");
+		fclose(in);
+		return LTR_E_SIZE;
+	}
+	if (size == 0)
+	{
+		fclose(in);
+		*data = (const u8*)"";
+		*len = 0;
+		return LTR_OK;
+	}
+	u8* buf = malloc(size);
+	if (buf == NULL)
+	{
+		fclose(in);
+		return LTR_E_ALLOC;
+	}
+	if (fread(buf, 1, size, in) != (size_t)size)
+	{
+		eprintf(V_ERR,"E* Unable to read input file %s!\n", filename);
+		free(buf);
+		fclose(in);
+		return LTR_E_OPEN;
+	}
+	fclose(in);
+	*data = buf;
+	*len = size;
+#endif
+	return LTR_OK;
+}
+
+static void input_release(const u8* data, size_t len)
+{
+	if (len == 0)
+		return;
+#ifdef HAVE_MMAP
+	munmap((void*)data, len);
+#else
+	free((void*)data);
+#endif
+}
+
+// map (or, failing that, read) an .ltr file and load it with ltr_load
+int ltr_load_file(const char* filename, const ltr_opts* o, ltrfile** out)
+{
+	ltr_opts c = *o;
+	const u8* data;
+	size_t len;
+	*out = NULL;
+	int ret = input_open(filename, c, MINFILESIZE, MAXFILESIZE, &data, &len);
+	if (ret != LTR_OK)
+		return ret;
+	ret = ltr_load(data, len, o, out);
+	input_release(data, len);
+	return ret;
+}
+
+void ltr_free(ltrfile* l)
+{
+	if (l == NULL)
+		return;
+	ltr_opts c = l->opts;
+	// a compiled model's tables all live in its image
+	if (l->image)
+	{
+		input_release(l->image, l->image_len);
+		free(l);
+		eprintf(V_FREE,"D* everything is freed!\n");
+		return;
+	}
+	// the tables share a single allocation with the ltrfile itself; only the
+	// optional sampling tables are separate
+	free(l->cdf);
+	free(l->lut);
+	free(l->alias);
+	free(l->sparse);
+	free(l->sparse_start);
+	free(l->cum);
+	free(l->reach);
+	free(l);
+	eprintf(V_FREE,"D* everything is freed!\n");
+}
+
+double get_mean_squared_error(f_array* input, u32 factor, u8 num_letters)
+{
+	double acc = 0.0;
+	for (u8 i = 0; i < num_letters; i++)
+	{
+		u32 nearest_int = round(input[i].pdf_data * factor);
+		acc += pow((input[i].pdf_data * factor) - (double)nearest_int, 2.0);
+	}
+	return acc/num_letters;
+}
+
+u32 f_array_count_buckets(f_array* f, u8 num_letters, ltr_opts c)
+{
+	u32 count = 0;
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		if (f[i].pdf_data != 0.0)
+			count++;
+	}
+	return count;
+}
+
+// smallest denominator of a continued fraction convergent of p which brings
+// p within eps of a fraction, i.e. the smallest k for which k*|p| is within
+// eps of an integer; 0 if there is none below limit. The float is expanded
+// exactly as mantissa/2^shift, so the convergents carry no rounding error.
+u32 cf_denominator(float p, double eps, u32 limit)
+{
+	int exp;
+	double mant = frexp(fabs(p), &exp);
+	if ((mant == 0.0) || (24 - exp > 62))
+		return 0;
+	u64 num = (u64)ldexp(mant, 24);
+	u64 den = (u64)1 << (24 - exp);
+	u64 k0 = 1, k1 = 0;
+	while (den)
+	{
+		u64 a = num / den;
+		u64 k = (a * k1) + k0;
+		if (k >= limit)
+			return 0;
+		double pk = fabs(p) * k;
+		if (fabs(pk - round(pk)) <= eps)
+			return (u32)k;
+		k0 = k1;
+		k1 = k;
+		u64 r = num % den;
+		num = den;
+		den = r;
+	}
+	return 0;
+}
+
+// rational reconstruction: the common denominator of all of the pdf values,
+// each reconstructed to within eps; 0 if it reaches limit.
+u32 f_array_reconstruct(f_array* f, u8 num_letters, double eps, u32 limit)
+{
+	u64 total = 1;
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		if (f[i].pdf_data == 0.0)
+			continue;
+		u32 d = cf_denominator(f[i].pdf_data, eps, limit);
+		if (d == 0)
+			return 0;
+		total = (total / gcd(total, d)) * d;
+		if (total >= limit)
+			return 0;
+	}
+	// 1 and 2 are caught before this is called, but the float noise in a
+	// table can still make them come out here; the smallest multiple which
+	// could be a guess is what an exhaustive search would find first.
+	while (total < 3)
+		total += (total == 2) ? 2 : 1;
+	return total;
+}
+
+// find the smallest integer that can be multiplied against all of the PDF
+// numbers that results in them being completely integer with nothing after
+// the decimal point; this is the number of words used to generate this list
+// in the first place.
+// That is the first guess from 3 up to MAXTOTAL with a mean squared error
+// below THRESH_DMAXALLOWED, or failing that the first guess with the lowest
+// error. Rational reconstruction of the pdf values finds it directly for most
+// tables; its error then bounds how far off an integer guess*p can be for the
+// smallest p, so only the few guesses near a multiple of 1/p need testing to
+// be sure nothing better was missed.
+u32 f_array_analyze(f_array* f, u8 num_letters, ltr_opts c)
+{
+	float minimum = 1.1;
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		if ((f[i].pdf_data != 0.0) && (f[i].pdf_data < minimum))
+			minimum = f[i].pdf_data;
+	}
+	if ((minimum == 1.1) || (fabs(1.1 - minimum) < THRESH_MAXALLOWED)) // we know for sure this table is empty.
+		return 0;
+	if (minimum == 1.0) // we know for sure this table has a single 1.0 value in it.
+		return 1;
+	if (minimum == 0.5) // we know for sure this table has exactly two 0.5 values in it.
+		return 2;
+	// beyond that we can't prove anything.
+
+	// reconstruct at the tolerance an exact guess has to meet, then at
+	// progressively looser ones for tables too large to be reconstructed from
+	// single floats; each success is a guess, and the best one bounds the rest.
+	double bound = INFINITY;
+	for (double eps = sqrt(num_letters * THRESH_DMAXALLOWED); eps < 0.5; eps *= 4)
+	{
+		u32 guess = f_array_reconstruct(f, num_letters, eps, MAXTOTAL);
+		if (guess == 0)
+			continue;
+		double this_error = get_mean_squared_error(f, guess, num_letters);
+		tprintf(V_MATH,"D* reconstructed a guess of %d (with an error of %f) at tolerance %f\n", guess, this_error, eps);
+		if (this_error < bound)
+			bound = this_error;
+		if (this_error < THRESH_DMAXALLOWED)
+			break;
+	}
+	if (bound < THRESH_DMAXALLOWED)
+		bound = THRESH_DMAXALLOWED;
+
+	// any guess at least as good as the bound has the smallest p within
+	// sqrt(num_letters * bound) of an integer after multiplying, since every
+	// value adds a non-negative term to the error; the smallest p keeps the
+	// number of multiples of 1/p to step over down.
+	float p = 1.1;
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		if ((f[i].pdf_data != 0.0) && (fabs(f[i].pdf_data) < p))
+			p = fabs(f[i].pdf_data);
+	}
+	double radius = sqrt(num_letters * bound);
+	if (radius >= 0.5) // no pruning is possible
+		radius = INFINITY;
+
+	double min_error = 1000000.0;
+	u32 best_guess = 0;
+	u32 guess = 3;
+	double m = 0.0;
+	while (guess < MAXTOTAL)
+	{
+		// the guesses which could bring p*guess within radius of m
+		double lo = 3.0;
+		double hi = MAXTOTAL;
+		if (!isinf(radius))
+		{
+			m = fmax(m, floor((p * guess) - radius));
+			lo = floor((m - radius) / p) - 1;
+			hi = ceil((m + radius) / p) + 1;
+		}
+		if (lo > guess)
+			guess = (lo < MAXTOTAL) ? lo : MAXTOTAL;
+		m++;
+		for (; (guess < MAXTOTAL) && (guess <= hi); guess++)
+		{
+			float pg = p * guess;
+			double d = pow(pg - round(pg), 2.0);
+			if ((d / num_letters) > bound)
+				continue;
+			double this_error = get_mean_squared_error(f, guess, num_letters);
+			if (this_error < min_error) // we have a better guess!
+			{
+				tprintf(V_MATH,"D* got a better guess (with an error of %f) of %d\n", this_error, guess);
+				best_guess = guess;
+				min_error = this_error;
+				if (min_error < THRESH_DMAXALLOWED)
+					return best_guess;
+				// only a strictly better guess can replace this one, so
+				// narrow the search around it
+				if (min_error < bound)
+				{
+					bound = min_error;
+					radius = (sqrt(num_letters * bound) < 0.5) ? sqrt(num_letters * bound) : INFINITY;
+					m = 0.0;
+					guess++;
+					break;
+				}
+			}
+		}
+	}
+	return best_guess;
+}
+
+// fill in the f_array->count values
+void f_array_populate(f_array* f, u8 num_letters, u32 count, ltr_opts c)
+{
+	for (u32 i = 0; i < num_letters; i++)
+		f[i].count = round(f[i].pdf_data * count);
+}
+
+void cdf_analyze(ltrfile* l, u32 t, ltr_opts c)
+{
+	cdf_array* p = LTR_CDF(l, t);
+	f_array* start = LTR_ROW(l, t, ROW_START);
+	f_array* middle = LTR_ROW(l, t, ROW_MIDDLE);
+	f_array* end = LTR_ROW(l, t, ROW_END);
+	// the shared empty row is left alone: its counts and totals are all zero
+	// already, and other threads may be reading it
+	if (LTR_ROW_INDEX(l, t, ROW_START))
+	{
+		p->start_buckets = f_array_count_buckets(start, l->num_letters, c);
+		p->start_total = f_array_analyze(start, l->num_letters, c);
+		f_array_populate(start, l->num_letters, p->start_total, c);
+	}
+	if (LTR_ROW_INDEX(l, t, ROW_MIDDLE))
+	{
+		p->middle_buckets = f_array_count_buckets(middle, l->num_letters, c);
+		p->middle_total = f_array_analyze(middle, l->num_letters, c);
+		f_array_populate(middle, l->num_letters, p->middle_total, c);
+	}
+	if (LTR_ROW_INDEX(l, t, ROW_END))
+	{
+		p->end_buckets = f_array_count_buckets(end, l->num_letters, c);
+		p->end_total = f_array_analyze(end, l->num_letters, c);
+		f_array_populate(end, l->num_letters, p->end_total, c);
+	}
+}
+
+// figure out whether the two integers are exact multiples
+// this is done by dividing the larger by the smaller and seeing
+// if the resulting number has a fractional portion that is exactly zero
+bool is_exact_multiple(u32 i, u32 j)
+{
+	if (i == j)
+		return true;
+	if (!i || !j) // a table that failed analysis; nothing is a multiple of it
+		return false;
+	float fi = i;
+	float fj = j;
+	float fg = fi;
+	float fl = fj;
+	if (fj > fg)
+	{
+		fg = fj;
+		fl = fi;
+	}
+	if (fabs((fg / fl) - round(fg / fl)) > THRESH_MAXALLOWED)
+		return false;
+	else
+		return true;
+}
+
+// one worker of the table analysis; worker w of n takes every n-th table
+// starting at w, so the expensive singles and doubles are spread out
+typedef struct analyze_worker
+{
+	ltrfile* l;
+	ltr_opts c;
+	u32 w;
+	u32 n;
+} analyze_worker;
+
+static void* analyze_tables(void* arg)
+{
+	analyze_worker* a = arg;
+	for (u32 t = a->w; t < LTR_NUM_TABLES(a->l->num_letters); t += a->n)
+		cdf_analyze(a->l, t, a->c);
+	return NULL;
+}
+
+void ltr_analyze(ltrfile* l, ltr_opts c)
+{
+	// every table's counts and total depend only on its own floats, so the
+	// tables are analyzed independently, in threads where possible. The math
+	// log is only readable in table order, so it forces a single thread.
+	u32 num_workers = c.threads ? c.threads : 1;
+	if (V_MATH || (num_workers > LTR_NUM_TABLES(l->num_letters)))
+		num_workers = V_MATH ? 1 : LTR_NUM_TABLES(l->num_letters);
+	analyze_worker workers[num_workers];
+	for (u32 w = 0; w < num_workers; w++)
+		workers[w] = (analyze_worker){ l, c, w, num_workers };
+#ifdef HAVE_PTHREAD
+	pthread_t tid[num_workers];
+	bool started[num_workers];
+	for (u32 w = 1; w < num_workers; w++)
+		started[w] = !pthread_create(&tid[w], NULL, analyze_tables, &workers[w]);
+	analyze_tables(&workers[0]);
+	for (u32 w = 1; w < num_workers; w++)
+	{
+		if (started[w])
+			pthread_join(tid[w], NULL);
+		else
+			analyze_tables(&workers[w]);
+	}
+#else
+	for (u32 w = 0; w < num_workers; w++)
+		analyze_tables(&workers[w]);
+#endif
+
+	// the rest reconciles tables against each other, and runs serially in a
+	// fixed order once all of the above is done
+
+	cdf_array* singles = LTR_CDF(l, LTR_SINGLES);
+	f_array* singles_start = LTR_ROW(l, LTR_SINGLES, ROW_START);
+	f_array* singles_end = LTR_ROW(l, LTR_SINGLES, ROW_END);
+
+	// the numbers of names should be correct but could be off by some factor, so lets do some heuristics to correct this
+	// first: whichever of the counts for the singles->start_total and singles->end_total is higher is automatically correct, if they're not the same AND are an even multiple of one another
+	// some files were hand-edited and hence the two singles tables will not be an exact multiple of one another, and if so, don't try to fix them here!
+	if (is_exact_multiple(singles->start_total,singles->end_total))
+	{
+		if (singles->start_total > singles->end_total) // start was higher
+		{
+			u32 c_factor = singles->start_total / singles->end_total;
+			tprintf(V_MATH,"D* fixing singles->end table by factor of %d:\n", c_factor);
+			// iterate through the table and correct the numerators
+			for (u32 i = 0; i < l->num_letters; i++)
+			{
+				singles_end[i].count *= c_factor;
+			}
+			// correct the denominator
+			singles->end_total = singles->start_total;
+		}
+		else if (singles->start_total < singles->end_total) // end was higher
+		{
+			u32 c_factor = singles->end_total / singles->start_total;
+			tprintf(V_MATH,"D* fixing singles->start table by factor of %d:\n", c_factor);
+			// iterate through the table and correct the numerators
+			for (u32 i = 0; i < l->num_letters; i++)
+			{
+				singles_start[i].count *= c_factor;
+			}
+			// correct the denominator
+			singles->start_total = singles->end_total;
+		}
+	}
+	else
+	{
+		tprintf(V_MATH,"D* cannot equalize start and end tables as they are not an even factor of one another!\n");
+	}
+
+	// next heuristic: if the singles->start[*] count for letter * doesn't equal the denominator for doubles[*]->start_total but is off by some factor, increase the latter to match
+	for (u32 i = 0; i < l->num_letters; i++)
+	{
+		if (singles_start[i].count != LTR_CDF(l, LTR_DOUBLES(l,i))->start_total)
+		{
+			tprintf(V_MATH,"D* count mismatch for singles->start[%c] (%d) vs doubles[%c]->start_total (%d)\n", ltr_letters[i], singles_start[i].count, ltr_letters[i], LTR_CDF(l, LTR_DOUBLES(l,i))->start_total);
+			if (is_exact_multiple(singles_start[i].count, LTR_CDF(l, LTR_DOUBLES(l,i))->start_total))
+			{
+				if ((singles_start[i].count > LTR_CDF(l, LTR_DOUBLES(l,i))->start_total) && LTR_CDF(l, LTR_DOUBLES(l,i))->start_total)
+				{
+					u32 c_factor = singles_start[i].count / LTR_CDF(l, LTR_DOUBLES(l,i))->start_total;
+					tprintf(V_MATH,"D* fixing table by factor of %d:\n", c_factor);
+					// iterate through the table and correct the numerators
+					for (u32 j = 0; j < l->num_letters; j++)
+					{
+						LTR_ROW(l, LTR_DOUBLES(l,i), ROW_START)[j].count *= c_factor;
+					}
+					// correct the denominator
+					LTR_CDF(l, LTR_DOUBLES(l,i))->start_total = singles_start[i].count;
+				}
+				else
+					tprintf(V_MATH,"D* cannot fix.\n");
+			}
+			else
+				tprintf(V_MATH,"D* cannot fix due to lack of common factor.\n");
+		}
+	}
+
+	// next heuristic: if the doubles[i]->start[*] count for letter * doesn't equal the denominator for triples[*][i]->start_total but is off by some factor, increase the latter to match
+	for (u32 i = 0; i < l->num_letters; i++)
+	{
+		for (u32 j = 0; j < l->num_letters; j++)
+		{
+			if (LTR_ROW(l, LTR_DOUBLES(l,i), ROW_START)[j].count != LTR_CDF(l, LTR_TRIPLES(l,i,j))->start_total)
+			{
+				tprintf(V_MATH,"D* count mismatch for doubles[%c]->start[%c] (%d) vs triples[%c][%c]->start_total (%d)\n", ltr_letters[i], ltr_letters[j], LTR_ROW(l, LTR_DOUBLES(l,i), ROW_START)[j].count, ltr_letters[i], ltr_letters[j], LTR_CDF(l, LTR_TRIPLES(l,i,j))->start_total);
+				if (is_exact_multiple(LTR_ROW(l, LTR_DOUBLES(l,i), ROW_START)[j].count, LTR_CDF(l, LTR_TRIPLES(l,i,j))->start_total))
+				{
+					if ((LTR_ROW(l, LTR_DOUBLES(l,i), ROW_START)[j].count > LTR_CDF(l, LTR_TRIPLES(l,i,j))->start_total) && LTR_CDF(l, LTR_TRIPLES(l,i,j))->start_total)
+					{
+						u32 c_factor = LTR_ROW(l, LTR_DOUBLES(l,i), ROW_START)[j].count / LTR_CDF(l, LTR_TRIPLES(l,i,j))->start_total;
+						tprintf(V_MATH,"D* fixing table by factor of %d:\n", c_factor);
+						// iterate through the table and correct the numerators
+						for (u32 k = 0; k < l->num_letters; k++)
+						{
+							LTR_ROW(l, LTR_TRIPLES(l,i,j), ROW_START)[k].count *= c_factor;
+						}
+						// correct the denominator
+						LTR_CDF(l, LTR_TRIPLES(l,i,j))->start_total = LTR_ROW(l, LTR_DOUBLES(l,i), ROW_START)[j].count;
+					}
+					else
+						tprintf(V_MATH,"D* cannot fix.\n");
+				}
+				else
+					tprintf(V_MATH,"D* cannot fix due to lack of common factor.\n");
+			}
+		}
+	}
+
+	// future heuristic: if the 'singles->end[n].count' is nonzero, and there is only one name for all m, where 'doubles[m]->end[n].count' is nonzero, propagate the count from 'singles->end[n].count' to 'doubles[m]->end[n].count'. Note that if the .ltr file is internally inconsistent due to hand-editing (the humanm and humanf files are definitely like this) do not attempt to do this, as it can propagate incorrect values!
+	// an interesting caveat of this is the denominator can be propagated this way, which will adjust the numerator and denominator of many other values in the end tables, if successful.
+	for (u32 i = 0; i < l->num_letters; i++)
+	{
+		u32 parents = 0;
+		u32 pidx = 0;
+		// if singles->end[i] is 0, don't bother.
+		if (!(singles_end[i].count))
+			continue;
+		// if doubles[j]->end[i] buckets is not exactly 1, don't bother.
+		//if (!(LTR_CDF(l, LTR_DOUBLES(l,j))->end_buckets == 1))
+		//	continue;
+		// which bucket is 1?
+		for (u32 j = 0; j < l->num_letters; j++)
+		{
+			if (LTR_ROW(l, LTR_DOUBLES(l,j), ROW_END)[i].count)
+			{
+				//tprintf(V_MATH,"D* l->doubles[%c]->end[%c].count is %d\n", ltr_letters[j], ltr_letters[i], LTR_ROW(l, LTR_DOUBLES(l,j), ROW_END)[i].count);
+				parents++;
+				pidx = j;
+			}
+		}
+		if (parents == 1)
+		{
+			if (LTR_ROW(l, LTR_DOUBLES(l,pidx), ROW_END)[i].count == singles_end[i].count)
+				tprintf(V_MATH,"D* found exactly one parent (doubles[%c]->end[%c], count of %d out of %d) of singles->end[%c] (count of %d out of %d), but the counts already match, so we don't need to do anything here.\n", ltr_letters[pidx], ltr_letters[i], LTR_ROW(l, LTR_DOUBLES(l,pidx), ROW_END)[i].count, LTR_CDF(l, LTR_DOUBLES(l,pidx))->end_total, ltr_letters[i], singles_end[i].count, singles->end_total);
+			else
+			{
+				tprintf(V_MATH,"D* found exactly one parent (doubles[%c]->end[%c], count of %d out of %d) of singles->end[%c] (count of %d out of %d), this may be a candidate for migration.\n", ltr_letters[pidx], ltr_letters[i], LTR_ROW(l, LTR_DOUBLES(l,pidx), ROW_END)[i].count, LTR_CDF(l, LTR_DOUBLES(l,pidx))->end_total, ltr_letters[i], singles_end[i].count, singles->end_total);
+				// attempt to migrate
+				//write me!
+				if (is_exact_multiple(LTR_ROW(l, LTR_DOUBLES(l,pidx), ROW_END)[i].count,singles_end[i].count))
+				{
+					tprintf(V_MATH,"D* factors are compatible, attempting migration.\n");
+					tprintf(V_MATH,"D* ... or would, if this was written yet.\n");
+					for (u32 m = 0; m < l->num_letters; m++)
+					{
+						// not done yet
+					}
+				}
+			}
+		}
+	}
+}
+
+void cdf_print(const ltrfile* l, u32 t, u8 k, u8 j, u8 num, int printcdf, FILE* out)
+{
+	cdf_array* p = LTR_CDF(l, t);
+	f_array* start = LTR_ROW(l, t, ROW_START);
+	f_array* middle = LTR_ROW(l, t, ROW_MIDDLE);
+	f_array* end = LTR_ROW(l, t, ROW_END);
+	u8 x = ' ';
+	u8 y = ' ';
+	u8 z = ' ';
+	for (u8 i = 0; i < l->num_letters; i++) {
+		// formatting
+		if (num == 0)
+		{
+			x = ltr_letters[i];
+		}
+		else if (num == 1)
+		{
+			x = ltr_letters[j];
+			y = ltr_letters[i];
+		}
+		else // num == 2
+		{
+			x = ltr_letters[k];
+			y = ltr_letters[j];
+			z = ltr_letters[i];
+		}
+		if ((printcdf == 2) || !((start[i].cdf_data == 0.0) && (middle[i].cdf_data == 0.0) && (end[i].cdf_data == 0.0)))
+		{
+			/*
+			printf("%c%c%c      |% .5f    % .5f  |% .5f     % .5f   |% .5f  % .5f\n",
+				x, y, z,
+				start[i].cdf_data, start[i].pdf_data,
+				middle[i].cdf_data, middle[i].pdf_data,
+				end[i].cdf_data, end[i].pdf_data);
+			*/
+			fprintf(out, "%c%c%c      |% .5f %5d /%5d |% .5f   %5d /%5d |% .5f %5d /%5d\n",
+				x, y, z,
+				start[i].cdf_data, start[i].count, p->start_total,
+				middle[i].cdf_data, middle[i].count,p->middle_total,
+				end[i].cdf_data, end[i].count,p->end_total);
+		}
+	}
+}
+
+void ltr_print(const ltrfile* l, int printcdf, FILE* out)
+{
+	if (!printcdf) return;
+	fprintf(out, "Number of letters in LTR: %d\n", l->num_letters);
+	fprintf(out, "Sequence | CDF(start)  P(start) | CDF(middle)  P(middle) | CDF(end)  P(end)\n");
+	cdf_print(l,LTR_SINGLES,' ',' ',0,printcdf,out);
+	for (u8 j = 0; j < l->num_letters; j++)
+	{
+		cdf_print(l,LTR_DOUBLES(l,j),' ',j,1,printcdf,out);
+	}
+	for (u8 k = 0; k < l->num_letters; k++)
+	{
+		for (u8 j = 0; j < l->num_letters; j++)
+		{
+			cdf_print(l,LTR_TRIPLES(l,k,j),k,j,2,printcdf,out);
+		}
+	}
+}
+
+void ltr_dumpstart(const ltrfile* l, FILE* out)
+{
+	fprintf(out, "D* %d names total:\n", LTR_CDF(l, LTR_SINGLES)->start_total);
+	for (u32 k = 0; k < l->num_letters; k++)
+	{
+		for (u32 j = 0; j < l->num_letters; j++)
+		{
+			for (u32 i = 0; i < l->num_letters; i++)
+			{
+				for (u32 h = LTR_ROW(l, LTR_TRIPLES(l,k,j), ROW_START)[i].count; h > 0; h--)
+				{
+					fprintf(out, "%c%c%c\n", ltr_letters[k], ltr_letters[j], ltr_letters[i]);
+				}
+			}
+		}
+	}
+}
+
+/*
+		if (LTR_ROW(l, LTR_SINGLES, ROW_START)[i].pdf_data != 0.0)
+		{
+			for (u32 m = 0; m < (LTR_ROW(l, LTR_SINGLES, ROW_START)[i].count * singles_m); m++)
+			{
+				printf("%c", ltr_letters[i]); // first letter
+				// deeper...
+				u32 doubles_m = (LTR_ROW(l, LTR_SINGLES, ROW_START)[i].count / LTR_CDF(l, LTR_DOUBLES(l,i))->start_total);
+				for (u32 j = 0; j < l->num_letters; j++)
+				{
+					if (LTR_ROW(l, LTR_DOUBLES(l,i), ROW_START)[j].pdf_data != 0.0)
+					{
+						for (u32 n = 0; n < (LTR_ROW(l, LTR_DOUBLES(l,i), ROW_START)[j].count * doubles_m); n++)
+						{
+							printf("%c", ltr_letters[j]); // second letter
+						}
+					}
+				}
+				printf("\n");
+			}
+		}
+*/
+
+// build a Walker/Vose alias table for one row. The weights are the integer
+// counts recovered by ltr_analyze where available, otherwise the pdf values.
+void alias_build_row(alias_entry* a, f_array* f, u8 num_letters)
+{
+	double w[28];
+	double sum = 0.0;
+	u8 small[28], large[28];
+	u32 ns = 0, nl = 0;
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		if (f[i].count >= 0)
+			w[i] = f[i].count;
+		else
+			w[i] = (f[i].pdf_data > 0.0) ? f[i].pdf_data : 0.0;
+		sum += w[i];
+	}
+	if (sum <= 0.0) // empty row, nothing can be picked from it
+	{
+		for (u32 i = 0; i < num_letters; i++)
+		{
+			a[i].prob = 0;
+			a[i].alias = num_letters;
+		}
+		return;
+	}
+	// scale so the average column weight is exactly 1.0
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		w[i] = (w[i] * num_letters) / sum;
+		if (w[i] < 1.0)
+			small[ns++] = i;
+		else
+			large[nl++] = i;
+	}
+	while (ns && nl)
+	{
+		u8 s = small[--ns];
+		u8 g = large[nl-1];
+		a[s].prob = (u32)(w[s] * ALIAS_ONE);
+		a[s].alias = g;
+		w[g] -= (1.0 - w[s]);
+		if (w[g] < 1.0)
+		{
+			nl--;
+			small[ns++] = g;
+		}
+	}
+	// whatever is left over is 1.0 give or take rounding error
+	while (nl)
+	{
+		u8 g = large[--nl];
+		a[g].prob = ALIAS_ONE;
+		a[g].alias = g;
+	}
+	while (ns)
+	{
+		u8 s = small[--ns];
+		a[s].prob = ALIAS_ONE;
+		a[s].alias = s;
+	}
+}
+
+// build alias tables for every row; needs ltr_analyze to have been run first
+// for the tables to match the original integer counts.
+bool ltr_build_alias(ltrfile* l, ltr_opts c)
+{
+	u32 num_rows = l->num_rows;
+	l->alias = malloc(num_rows * l->num_letters * sizeof(alias_entry));
+	if (l->alias == NULL)
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for alias tables!\n");
+		return false;
+	}
+	for (u32 r = 0; r < num_rows; r++)
+		alias_build_row(l->alias + (r * l->num_letters), l->rows + (r * l->num_letters), l->num_letters);
+	eprintf(V_LOAD,"D* built alias tables for %d rows\n", num_rows);
+	return true;
+}
+
+// Count thresholds: each stored row becomes the running totals of its
+// letters' counts, so its last entry is the row's total. A roll of
+// COUNT_BITS bits is scaled to a value below the total with a multiply and
+// a shift, and the letter picked is the number of running totals at or
+// below that value; letters with no count never are, since their running
+// total is the same as the letter before's. Each letter is picked by
+// exactly floor or ceil of count / total * 2^COUNT_BITS of the rolls,
+// whatever the compiler does with floats. A row whose counts ltr_analyze
+// couldn't recover falls back to its floats, scaled to COUNT_FALLBACK.
+// Rows are padded to COUNT_STRIDE with totals no value reaches, so that
+// the vectorized count search can compare whole rows at once.
+#define COUNT_BITS     (30)
+#define COUNT_FALLBACK (1 << 24)
+#define COUNT_STRIDE   (32)
+
+static void count_build_row(u32* cum, const f_array* f, u8 num_letters)
+{
+	bool counted = true;
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		if ((f[i].cdf_data != 0.0) && (f[i].count <= 0))
+			counted = false;
+	}
+	u32 acc = 0;
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		if (counted)
+			acc += (f[i].count > 0) ? f[i].count : 0;
+		else if (f[i].pdf_data > 0.0)
+			acc += fmax(round(f[i].pdf_data * COUNT_FALLBACK), 1.0);
+		cum[i] = acc;
+	}
+	for (u32 i = num_letters; i < COUNT_STRIDE; i++)
+		cum[i] = UINT32_MAX;
+}
+
+// build count thresholds for every row; needs the counts from ltr_analyze
+// or a counts file
+bool ltr_build_count(ltrfile* l, ltr_opts c)
+{
+	u32 num_rows = l->num_rows;
+	l->cum = malloc(num_rows * COUNT_STRIDE * sizeof(u32));
+	if (l->cum == NULL)
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for count thresholds!\n");
+		return false;
+	}
+	for (u32 r = 0; r < num_rows; r++)
+		count_build_row(l->cum + (r * COUNT_STRIDE), l->rows + (r * l->num_letters), l->num_letters);
+	eprintf(V_LOAD,"D* built count thresholds for %d rows\n", num_rows);
+	return true;
+}
+
+// cdf search kernels: each returns the index of the first entry of a packed
+// row that the roll is below, or num_letters if there is none, exactly as the
+// scalar loop does.
+typedef u8 (*cdf_search_fn)(const float* cdf, u8 num_letters, float rng);
+
+static u8 cdf_search_scalar(const float* cdf, u8 num_letters, float rng)
+{
+	u8 k;
+	for (k = 0; k < num_letters; k++)
+	{
+		if (rng < cdf[k])
+			break;
+	}
+	return k;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static u8 cdf_search_sse2(const float* cdf, u8 num_letters, float rng)
+{
+	__m128 r = _mm_set1_ps(rng);
+	u32 mask = 0;
+	for (u32 i = 0; i < CDF_STRIDE; i += 4)
+		mask |= ((u32)_mm_movemask_ps(_mm_cmplt_ps(r, _mm_loadu_ps(cdf + i)))) << i;
+	return mask ? __builtin_ctz(mask) : num_letters;
+}
+
+__attribute__((target("avx2")))
+static u8 cdf_search_avx2(const float* cdf, u8 num_letters, float rng)
+{
+	__m256 r = _mm256_set1_ps(rng);
+	u32 mask = 0;
+	for (u32 i = 0; i < CDF_STRIDE; i += 8)
+		mask |= ((u32)_mm256_movemask_ps(_mm256_cmp_ps(r, _mm256_loadu_ps(cdf + i), _CMP_LT_OQ))) << i;
+	return mask ? __builtin_ctz(mask) : num_letters;
+}
+#endif
+
+// count search kernels: each returns the index of the first running total of
+// a count threshold row that is above the value, which is the number at or
+// below it, as the scalar loop does. There are no unsigned compares before
+// AVX-512, so both sides are offset into signed range first.
+typedef u8 (*count_search_fn)(const u32* cum, u8 num_letters, u32 v);
+
+static u8 count_search_scalar(const u32* cum, u8 num_letters, u32 v)
+{
+	u8 k;
+	for (k = 0; k < num_letters; k++)
+	{
+		if (v < cum[k])
+			break;
+	}
+	return k;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static u8 count_search_sse2(const u32* cum, u8 num_letters, u32 v)
+{
+	__m128i bias = _mm_set1_epi32(0x80000000);
+	__m128i x = _mm_xor_si128(_mm_set1_epi32(v), bias);
+	u32 mask = 0;
+	for (u32 i = 0; i < COUNT_STRIDE; i += 4)
+		mask |= ((u32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_xor_si128(_mm_loadu_si128((const __m128i*)(cum + i)), bias), x)))) << i;
+	return mask ? __builtin_ctz(mask) : num_letters;
+}
+
+__attribute__((target("avx2")))
+static u8 count_search_avx2(const u32* cum, u8 num_letters, u32 v)
+{
+	__m256i bias = _mm256_set1_epi32(0x80000000);
+	__m256i x = _mm256_xor_si256(_mm256_set1_epi32(v), bias);
+	u32 mask = 0;
+	for (u32 i = 0; i < COUNT_STRIDE; i += 8)
+		mask |= ((u32)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(cum + i)), bias), x)))) << i;
+	return mask ? __builtin_ctz(mask) : num_letters;
+}
+#endif
+
+static cdf_search_fn cdf_search = cdf_search_scalar;
+static count_search_fn count_search = count_search_scalar;
+static const char* cdf_search_name = "scalar";
+
+// pick the best cdf and count search kernels this cpu supports
+static void cdf_search_select(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		cdf_search = cdf_search_avx2;
+		count_search = count_search_avx2;
+		ms_lanes = ms_lanes_avx2;
+		cdf_search_name = "avx2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		cdf_search = cdf_search_sse2;
+		count_search = count_search_sse2;
+		cdf_search_name = "sse2";
+	}
+#endif
+}
+
+// models may be loaded from several threads at once, so only select once
+void cdf_search_init(void)
+{
+#ifdef HAVE_PTHREAD
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, cdf_search_select);
+#else
+	static bool done = false;
+	if (!done)
+		cdf_search_select();
+	done = true;
+#endif
+}
+
+// build the packed cdf rows used by cdf_search
+bool ltr_build_cdf(ltrfile* l, ltr_opts c)
+{
+	u32 num_rows = l->num_rows;
+	l->cdf = malloc(num_rows * CDF_STRIDE * sizeof(float));
+	if (l->cdf == NULL)
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for packed cdf tables!\n");
+		return false;
+	}
+	for (u32 r = 0; r < num_rows; r++)
+	{
+		for (u32 i = 0; i < CDF_STRIDE; i++)
+			l->cdf[(r * CDF_STRIDE) + i] = (i < l->num_letters) ? l->rows[(r * l->num_letters) + i].cdf_data : 0.0;
+	}
+	cdf_search_init();
+	eprintf(V_LOAD,"D* using %s cdf search\n", cdf_search_name);
+	return true;
+}
+
+// compile one cdf row into a lut_row, using exactly the same comparison as
+// the SAMPLER_CDF scan so that every roll maps to the same letter.
+void lut_build_row(lut_row* p, f_array* f, u8 num_letters)
+{
+	u32 prev = 0;
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		// first guess, then nudge it until it's the exact boundary
+		double guess = ceil((double)f[i].cdf_data * MSRAND_MAX);
+		u32 r = (guess <= 0.0) ? 0 : (guess > MSRAND_MAX) ? (MSRAND_MAX+1) : (u32)guess;
+		while ((r > 0) && !(((float)(r-1) / MSRAND_MAX) < f[i].cdf_data))
+			r--;
+		while ((r <= MSRAND_MAX) && (((float)r / MSRAND_MAX) < f[i].cdf_data))
+			r++;
+		// the scan stops at the first letter whose cdf exceeds the roll, so
+		// a non-monotonic (unfixed) row behaves as its running maximum.
+		if (r < prev)
+			r = prev;
+		p->thresh[i] = prev = r;
+	}
+	for (u32 i = num_letters; i < 28+1; i++)
+		p->thresh[i] = 0xffff;
+	for (u32 b = 0, k = 0; b < LUT_BUCKETS; b++)
+	{
+		while (p->thresh[k] <= (b << LUT_SHIFT))
+			k++;
+		p->base[b] = k;
+	}
+}
+
+// build roll lookup tables for every row
+bool ltr_build_lut(ltrfile* l, ltr_opts c)
+{
+	u32 num_rows = l->num_rows;
+	l->lut = malloc(num_rows * sizeof(lut_row));
+	if (l->lut == NULL)
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for roll lookup tables!\n");
+		return false;
+	}
+	for (u32 r = 0; r < num_rows; r++)
+		lut_build_row(l->lut + r, l->rows + (r * l->num_letters), l->num_letters);
+	eprintf(V_LOAD,"D* built roll lookup tables for %d rows\n", num_rows);
+	return true;
+}
+
+// build the sparse rows: the letters each stored row can actually pick, in
+// scan order, each packed with the first roll past it. A letter's range of
+// rolls is empty when its threshold doesn't rise, so those are left out. The
+// thresholds come from the roll lookup tables, so ltr_build_lut goes first.
+bool ltr_build_sparse(ltrfile* l, ltr_opts c)
+{
+	u32 num_rows = l->num_rows;
+	u32 num_sparse = 0;
+	for (u32 r = 0; r < num_rows; r++)
+	{
+		for (u32 i = 0, prev = 0; i < l->num_letters; i++)
+		{
+			if (l->lut[r].thresh[i] > prev)
+			{
+				num_sparse++;
+				prev = l->lut[r].thresh[i];
+			}
+		}
+	}
+	l->sparse_start = malloc((num_rows + 1) * sizeof(u32));
+	l->sparse = malloc((num_sparse ? num_sparse : 1) * sizeof(u32));
+	if ((l->sparse_start == NULL) || (l->sparse == NULL))
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for sparse rows!\n");
+		return false;
+	}
+	u32 e = 0;
+	for (u32 r = 0; r < num_rows; r++)
+	{
+		l->sparse_start[r] = e;
+		for (u32 i = 0, prev = 0; i < l->num_letters; i++)
+		{
+			if (l->lut[r].thresh[i] > prev)
+			{
+				prev = l->lut[r].thresh[i];
+				l->sparse[e++] = (prev << 8) | i;
+			}
+		}
+	}
+	l->sparse_start[num_rows] = e;
+	l->num_sparse = num_sparse;
+	eprintf(V_LOAD,"D* built sparse rows with %d entries for %d rows\n", num_sparse, num_rows);
+	return true;
+}
+
+// Work out, for each (i, j) letter pair state, the fewest letters a name can
+// still need to end: one if the end row of triples[i][j] can pick anything,
+// otherwise one more than the best state its middle row can lead to. Paths
+// longer than a name can be count as never ending. This uses the sparse rows
+// to tell which letters a row can pick, so ltr_build_sparse goes first.
+bool ltr_build_reach(ltrfile* l, ltr_opts c)
+{
+	u32 n = l->num_letters;
+	l->reach = malloc(n * n * 2);
+	if (l->reach == NULL)
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for state reachability!\n");
+		return false;
+	}
+	l->reach_middle = l->reach + (n * n);
+	for (u32 i = 0; i < n; i++)
+	{
+		for (u32 j = 0; j < n; j++)
+		{
+			u32 row = LTR_ROW_INDEX(l, LTR_TRIPLES(l,i,j), ROW_END);
+			l->reach[LTR_STATE(l,i,j)] = (l->sparse_start[row] < l->sparse_start[row + 1]) ? 1 : REACH_NEVER;
+			l->reach_middle[LTR_STATE(l,i,j)] = REACH_NEVER;
+		}
+	}
+	// relax until nothing improves; every pass settles at least one more
+	// letter of distance, so this takes at most LTR_NAME_MAX passes
+	u32 passes = 0;
+	for (bool changed = true; changed; passes++)
+	{
+		changed = false;
+		for (u32 i = 0; i < n; i++)
+		{
+			for (u32 j = 0; j < n; j++)
+			{
+				u32 row = LTR_ROW_INDEX(l, LTR_TRIPLES(l,i,j), ROW_MIDDLE);
+				u8* rm = l->reach_middle + LTR_STATE(l,i,j);
+				for (u32 e = l->sparse_start[row]; e < l->sparse_start[row + 1]; e++)
+				{
+					u32 d = l->reach[LTR_STATE(l, j, l->sparse[e] & 0xff)] + 1;
+					if ((d < LTR_NAME_MAX) && (d < *rm))
+					{
+						*rm = d;
+						changed = true;
+					}
+				}
+				if (*rm < l->reach[LTR_STATE(l,i,j)])
+					l->reach[LTR_STATE(l,i,j)] = *rm;
+			}
+		}
+	}
+	u32 dead = 0;
+	for (u32 i = 0; i < n; i++)
+	{
+		for (u32 j = 0; j < n; j++)
+		{
+			if (l->reach[LTR_STATE(l,i,j)] == REACH_NEVER)
+			{
+				eprintf(V_LOAD2,"D* state %c%c can never end a name\n", ltr_letters[i], ltr_letters[j]);
+				dead++;
+			}
+		}
+	}
+	eprintf(V_LOAD,"D* %d of %d letter pair states can never end a name, found in %d passes\n", dead, n * n, passes);
+	return true;
+}
+
+// memory taken by a model's tables
+static size_t ltr_model_bytes(const ltrfile* l)
+{
+	u32 num_tables = LTR_NUM_TABLES(l->num_letters);
+	size_t size = (num_tables * sizeof(cdf_array)) + (num_tables * 3 * sizeof(u16)) + ((size_t)l->num_rows * l->num_letters * sizeof(f_array));
+	if (l->cdf)
+		size += (size_t)l->num_rows * CDF_STRIDE * sizeof(float);
+	if (l->lut)
+		size += (size_t)l->num_rows * sizeof(lut_row);
+	if (l->alias)
+		size += (size_t)l->num_rows * l->num_letters * sizeof(alias_entry);
+	if (l->cum)
+		size += (size_t)l->num_rows * COUNT_STRIDE * sizeof(u32);
+	if (l->sparse)
+		size += ((l->num_rows + 1) + l->num_sparse) * sizeof(u32);
+	if (l->reach)
+		size += l->num_letters * l->num_letters * 2;
+	return size;
+}
+
+// build the tables for every sampler, so that generators using any of them
+// can share the model without ever modifying it
+bool ltr_build_samplers(ltrfile* l, ltr_opts c)
+{
+	return ltr_build_cdf(l, c) && ltr_build_lut(l, c) && ltr_build_sparse(l, c) && ltr_build_reach(l, c) && ltr_build_alias(l, c) && ltr_build_count(l, c);
+}
+
+// decode, fix and analyze an .ltr image from memory, and build its sampling
+// tables. data only needs to stay valid for the duration of the call.
+int ltr_load(const u8* data, u32 len, const ltr_opts* o, ltrfile** out)
+{
+	ltr_opts c = *o;
+	METRIC(u64 t = ltr_clock_ns();)
+	int ret = ltr_decode(data, len, out, c);
+	METRIC(metrics_phase(METRIC_DECODE, t); t = ltr_clock_ns();)
+	if (ret != LTR_OK)
+		return ret;
+	ltr_fix(*out, c);
+	METRIC(metrics_phase(METRIC_FIX, t); t = ltr_clock_ns();)
+	ltr_analyze(*out, c);
+	METRIC(metrics_phase(METRIC_ANALYZE, t); t = ltr_clock_ns();)
+	bool built = c.tables_only || ltr_build_samplers(*out, c);
+	METRIC(metrics_phase(METRIC_BUILD, t);)
+	if (!built)
+	{
+		ltr_free(*out);
+		*out = NULL;
+		return LTR_E_ALLOC;
+	}
+	eprintf(V_LOAD,"D* model tables take %zu bytes\n", ltr_model_bytes(*out));
+	return LTR_OK;
+}
+
+u8 ltr_num_letters(const ltrfile* l)
+{
+	return l->num_letters;
+}
+
+// FNV-1a over an .ltr image; compiled models are keyed by it
+u64 ltr_hash(const u8* data, size_t len)
+{
+	u64 h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* compiled models
+ *
+ * A compiled model (.ltrc) is an ltrfile's tables written out exactly as
+ * they are laid out in memory, behind a header saying which .ltr image and
+ * options they came from. Loading one maps it read-only and points the model
+ * straight into it, so nothing is decoded, fixed, analyzed or built, and all
+ * of the processes using the same file share its pages. It is only meant to
+ * be read back by the same build on the same kind of host; any difference in
+ * byte order or table layout makes it stale, the same as a changed source.
+ * The tables are followed without checks while generating, so the header
+ * also carries a checksum of everything after it, and a damaged file is
+ * treated as stale too.
+ */
+#define LTRC_MAGIC      "LTRC V1"
+#define LTRC_VERSION    (5)
+#define LTRC_BYTE_ORDER (0x01020304)
+#define LTRC_ALIGN      (64)
+
+enum { LTRC_TABLES, LTRC_ROW_OF, LTRC_ROWS, LTRC_CDF, LTRC_LUT, LTRC_ALIAS, LTRC_SPARSE_START, LTRC_SPARSE, LTRC_REACH, LTRC_COUNT, LTRC_SECTIONS };
+
+typedef struct ltrc_header
+{
+	char magic[8]; // LTRC_MAGIC, zero padded
+	u32 byte_order; // LTRC_BYTE_ORDER, as the writing host stores it
+	u32 version; // LTRC_VERSION
+	u16 sizes[4]; // sizes of cdf_array, f_array, lut_row and alias_entry
+	u32 cdf_stride; // CDF_STRIDE
+	u8 num_letters;
+	u8 fix; // whether the singles were fixed
+	u8 pad[2];
+	u32 num_rows; // stored rows
+	u32 num_sparse; // sparse row entries
+	u64 source_hash; // ltr_hash of the .ltr image
+	u64 payload_hash; // ltrc_checksum of everything after the header
+	u64 off[LTRC_SECTIONS]; // where each section starts, LTRC_ALIGN aligned
+	u64 len; // size of the whole file
+} ltrc_header;
+
+// where each section of a compiled model goes, and how much of it is used;
+// the rest, up to the next section, is zero padding
+static void ltrc_layout(u8 num_letters, u32 num_rows, u32 num_sparse, u64* off, u64* used, u64* len)
+{
+	u32 num_tables = LTR_NUM_TABLES(num_letters);
+	u64 size[LTRC_SECTIONS] =
+	{
+		num_tables * sizeof(cdf_array),
+		num_tables * 3 * sizeof(u16),
+		(u64)num_rows * num_letters * sizeof(f_array),
+		(u64)num_rows * CDF_STRIDE * sizeof(float),
+		num_rows * sizeof(lut_row),
+		(u64)num_rows * num_letters * sizeof(alias_entry),
+		(num_rows + 1) * sizeof(u32),
+		num_sparse * sizeof(u32),
+		num_letters * num_letters * 2,
+		(u64)num_rows * COUNT_STRIDE * sizeof(u32),
+	};
+	u64 pos = sizeof(ltrc_header);
+	for (u32 s = 0; s < LTRC_SECTIONS; s++)
+	{
+		pos = (pos + LTRC_ALIGN - 1) & ~(u64)(LTRC_ALIGN - 1);
+		off[s] = pos;
+		if (used)
+			used[s] = size[s];
+		pos += size[s];
+	}
+	*len = pos;
+}
+
+static void ltrc_header_fill(ltrc_header* h, u8 num_letters, u32 num_rows, u32 num_sparse)
+{
+	memset(h, 0, sizeof(ltrc_header));
+	memcpy(h->magic, LTRC_MAGIC, sizeof(LTRC_MAGIC));
+	h->byte_order = LTRC_BYTE_ORDER;
+	h->version = LTRC_VERSION;
+	h->sizes[0] = sizeof(cdf_array);
+	h->sizes[1] = sizeof(f_array);
+	h->sizes[2] = sizeof(lut_row);
+	h->sizes[3] = sizeof(alias_entry);
+	h->cdf_stride = CDF_STRIDE;
+	h->num_letters = num_letters;
+	h->num_rows = num_rows;
+	h->num_sparse = num_sparse;
+	ltrc_layout(num_letters, num_rows, num_sparse, h->off, NULL, &h->len);
+}
+
+// FNV-1a over 64 bit words, in four interleaved lanes so that checking a
+// large model doesn't wait on one long chain of multiplies
+static u64 ltrc_checksum(const u8* data, size_t len)
+{
+	u64 h[4] = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL, 0xcbf29ce4cbf29ce4ULL, 0x8422232584222325ULL };
+	size_t i = 0;
+	for (; (i + 32) <= len; i += 32)
+	{
+		for (u32 k = 0; k < 4; k++)
+		{
+			u64 w;
+			memcpy(&w, data + i + (k * 8), 8);
+			h[k] = (h[k] ^ w) * 0x100000001b3ULL;
+		}
+	}
+	for (; i < len; i++)
+		h[0] = (h[0] ^ data[i]) * 0x100000001b3ULL;
+	for (u32 k = 1; k < 4; k++)
+		h[0] = (h[0] * 0x100000001b3ULL) ^ h[k];
+	return h[0];
+}
+
+// write a fully built model out as a compiled model. The file is written
+// under a temporary name and renamed into place, so anything mapping the old
+// one keeps a consistent copy.
+int ltr_save_compiled(const ltrfile* l, const char* filename)
+{
+	ltr_opts c = l->opts;
+	if (!l->cdf || !l->lut || !l->alias || !l->sparse || !l->reach || !l->cum)
+		return LTR_E_PARAM;
+	ltrc_header h;
+	ltrc_header_fill(&h, l->num_letters, l->num_rows, l->num_sparse);
+	h.fix = c.fix;
+	h.source_hash = l->hash;
+	const void* data[LTRC_SECTIONS] = { l->tables, l->row_of, l->rows, l->cdf, l->lut, l->alias, l->sparse_start, l->sparse, l->reach, l->cum };
+	u64 off[LTRC_SECTIONS], used[LTRC_SECTIONS], len;
+	ltrc_layout(l->num_letters, l->num_rows, l->num_sparse, off, used, &len);
+	// the whole file is put together first, so it can be checksummed
+	u8* image = calloc(1, h.len);
+	if (!image)
+		return LTR_E_ALLOC;
+	memcpy(image, &h, sizeof(h));
+	for (u32 s = 0; s < LTRC_SECTIONS; s++)
+		memcpy(image + off[s], data[s], used[s]);
+	h.payload_hash = ltrc_checksum(image + sizeof(h), h.len - sizeof(h));
+	memcpy(image, &h, sizeof(h));
+
+	char tmpname[4096];
+#ifdef HAVE_MMAP
+	snprintf(tmpname, sizeof(tmpname), "%s.%ld.tmp", filename, (long)getpid());
+#else
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+#endif
+	FILE* out = fopen(tmpname, "wb");
+	if (!out)
+	{
+		eprintf(V_ERR,"E* Unable to open output file %s!\n", tmpname);
+		free(image);
+		return LTR_E_WRITE;
+	}
+	bool ok = (fwrite(image, 1, h.len, out) == h.len);
+	free(image);
+	if (fclose(out) || !ok || rename(tmpname, filename))
+	{
+		eprintf(V_ERR,"E* Unable to write compiled model %s!\n", filename);
+		remove(tmpname);
+		return LTR_E_WRITE;
+	}
+	eprintf(V_LOAD,"D* wrote compiled model %s, %llu bytes\n", filename, (unsigned long long)h.len);
+	return LTR_OK;
+}
+
+// see ltr_load_compiled
+static int ltrc_load(const char* filename, const u64* hash, const ltr_opts* o, ltrfile** out)
+{
+	ltr_opts c = *o;
+	const u8* data;
+	size_t len;
+	u64 maxlen;
+	u64 off[LTRC_SECTIONS];
+	*out = NULL;
+	u32 max_rows = (LTR_NUM_TABLES(28) * 3) + 1;
+	ltrc_layout(28, max_rows, max_rows * 28, off, NULL, &maxlen);
+	int ret = input_open(filename, c, sizeof(ltrc_header), maxlen, &data, &len);
+	if (ret != LTR_OK)
+		return ret;
+
+	// everything in the header has to be what this build would have written
+	const ltrc_header* h = (const ltrc_header*)data;
+	ltrc_header want;
+	if (memcmp(h->magic, LTRC_MAGIC, sizeof(LTRC_MAGIC)))
+	{
+		eprintf(V_ERR,"E* Incorrect magic number!\n");
+		ret = LTR_E_MAGIC;
+	}
+	else if ((h->num_letters < 1) || (h->num_letters > 28))
+	{
+		eprintf(V_ERR,"E* Invalid number of letters %d!\n", h->num_letters);
+		ret = LTR_E_LETTERS;
+	}
+	else if ((h->num_rows < 4) || (h->num_rows > (LTR_NUM_TABLES(h->num_letters) * 3) + 1) || (h->num_sparse > h->num_rows * h->num_letters))
+	{
+		eprintf(V_ERR,"E* Compiled model %s has an invalid number of rows!\n", filename);
+		ret = LTR_E_STALE;
+	}
+	else
+	{
+		ltrc_header_fill(&want, h->num_letters, h->num_rows, h->num_sparse);
+		if ((h->byte_order != want.byte_order) || (h->version != want.version) || memcmp(h->sizes, want.sizes, sizeof(want.sizes))
+			|| (h->cdf_stride != want.cdf_stride) || memcmp(h->off, want.off, sizeof(want.off)) || (h->len != want.len))
+		{
+			eprintf(V_LOAD,"D* compiled model %s was written by a different build\n", filename);
+			ret = LTR_E_STALE;
+		}
+		else if (len != want.len)
+		{
+			eprintf(V_ERR,"E* Compiled model %s is truncated!\n", filename);
+			ret = LTR_E_TRUNCATED;
+		}
+		else if ((h->fix != c.fix) || (hash && (*hash != h->source_hash)))
+		{
+			eprintf(V_LOAD,"D* compiled model %s does not match its source or options\n", filename);
+			ret = LTR_E_STALE;
+		}
+		else if (ltrc_checksum(data + sizeof(ltrc_header), len - sizeof(ltrc_header)) != h->payload_hash)
+		{
+			eprintf(V_ERR,"E* Compiled model %s is damaged!\n", filename);
+			ret = LTR_E_STALE;
+		}
+	}
+	ltrfile* l = NULL;
+	if ((ret == LTR_OK) && !(l = malloc(sizeof(ltrfile))))
+		ret = LTR_E_ALLOC;
+	if (ret != LTR_OK)
+	{
+		input_release(data, len);
+		return ret;
+	}
+
+	memcpy(l->magic, "LTR V1.0", 8);
+	l->num_letters = h->num_letters;
+	l->opts = c;
+	l->hash = h->source_hash;
+	l->tables = (cdf_array*)(data + h->off[LTRC_TABLES]);
+	l->row_of = (u16*)(data + h->off[LTRC_ROW_OF]);
+	l->num_rows = h->num_rows;
+	l->rows = (f_array*)(data + h->off[LTRC_ROWS]);
+	l->cdf = (float*)(data + h->off[LTRC_CDF]);
+	l->lut = (lut_row*)(data + h->off[LTRC_LUT]);
+	l->alias = (alias_entry*)(data + h->off[LTRC_ALIAS]);
+	l->sparse_start = (u32*)(data + h->off[LTRC_SPARSE_START]);
+	l->sparse = (u32*)(data + h->off[LTRC_SPARSE]);
+	l->num_sparse = h->num_sparse;
+	l->reach = (u8*)(data + h->off[LTRC_REACH]);
+	l->reach_middle = l->reach + (l->num_letters * l->num_letters);
+	l->cum = (u32*)(data + h->off[LTRC_COUNT]);
+	l->image = data;
+	l->image_len = len;
+	// the row indexes are followed without checks while generating
+	bool valid = (l->sparse_start[0] == 0) && (l->sparse_start[l->num_rows] == l->num_sparse);
+	for (u32 r = 0; valid && (r < LTR_NUM_TABLES(l->num_letters) * 3); r++)
+		valid = (l->row_of[r] < l->num_rows);
+	for (u32 r = 0; valid && (r < l->num_rows); r++)
+		valid = (l->sparse_start[r] <= l->sparse_start[r + 1]);
+	if (!valid)
+	{
+		eprintf(V_ERR,"E* Compiled model %s has invalid row indexes!\n", filename);
+		ltr_free(l);
+		return LTR_E_STALE;
+	}
+	cdf_search_init();
+	eprintf(V_LOAD,"D* loaded compiled model %s\n", filename);
+	*out = l;
+	return LTR_OK;
+}
+
+// load a compiled model in place. If hash is not NULL, the model must have
+// been compiled from an .ltr image with that hash; it must always have been
+// compiled with the same fix option.
+int ltr_load_compiled(const char* filename, const u64* hash, const ltr_opts* o, ltrfile** out)
+{
+	METRIC(u64 t = ltr_clock_ns();)
+	int ret = ltrc_load(filename, hash, o, out);
+	METRIC(metrics_phase(METRIC_COMPILED, t);)
+	return ret;
+}
+
+// load an .ltr file through a compiled model cache: cachefile is used if it
+// was compiled from the same .ltr contents with the same options, and is
+// otherwise (re)written from a normal load.
+int ltr_load_cached(const char* filename, const char* cachefile, const ltr_opts* o, ltrfile** out)
+{
+	ltr_opts c = *o;
+	const u8* data;
+	size_t len;
+	*out = NULL;
+	int ret = input_open(filename, c, MINFILESIZE, MAXFILESIZE, &data, &len);
+	if (ret != LTR_OK)
+		return ret;
+	u64 hash = ltr_hash(data, len);
+	FILE* probe = fopen(cachefile, "rb"); // a missing cache is not an error
+	if (probe)
+	{
+		fclose(probe);
+		if (ltr_load_compiled(cachefile, &hash, o, out) == LTR_OK)
+		{
+			input_release(data, len);
+			return LTR_OK;
+		}
+	}
+	ret = ltr_load(data, len, o, out);
+	input_release(data, len);
+	if ((ret == LTR_OK) && !c.tables_only && (ltr_save_compiled(*out, cachefile) != LTR_OK))
+		eprintf(V_ERR,"W* continuing without a compiled model\n");
+	return ret;
+}
+
+/* training
+ *
+ * An ltr_counts holds how often each letter starts, continues and ends a
+ * name after each letter and letter pair, laid out exactly like an .ltr
+ * file's floats: every singles, doubles and triples table has a start,
+ * middle and end row of num_letters counts. A name of letters a[0..n-1] adds
+ * one to
+ *   start:  singles[a0], doubles[a0][a1], triples[a0][a1][a2]
+ *   middle: singles[ap], doubles[ap-1][ap], and from p = 2
+ *           triples[ap-2][ap-1][ap], for every p from 1 to n-2
+ *   end:    singles[an-1], doubles[an-2][an-1], triples[an-3][an-2][an-1]
+ * which is what ltr_analyze recovers from Bioware's files. Only names of 4
+ * to LTR_NAME_MAX - 1 letters are counted, as no generator can produce any
+ * others.
+ *
+ * A name list is counted by splitting it at line breaks into one range per
+ * thread, each counted into a table of its own, and the tables added up at
+ * the end. The counts can be written out as an .ltr file, along with a
+ * counts file (.ltrn) keyed by that .ltr's hash, which ltr_load_counted uses
+ * in place of the analysis.
+ */
+#define LTRN_MAGIC      "LTRN V1"
+#define COUNT_MIN_NAME  (4)
+#define COUNT_MIN_CHUNK (1 << 16) // bytes of names below which another thread isn't worth it
+#define LTR_COUNTS_CELLS(n) (LTR_NUM_TABLES(n) * 3 * (u32)(n))
+#define LTR_COUNT(t,table,r,k) ((t)->counts[((((table) * 3) + (r)) * (t)->num_letters) + (k)])
+
+struct ltr_counts
+{
+	u8 num_letters;
+	s64 names; // names counted, less names removed
+	s64* counts; // LTR_COUNTS_CELLS(num_letters) entries
+	u8 letter_of[256]; // letter index of each byte, or 0xff if not in the alphabet
+};
+
+typedef struct ltrn_header
+{
+	char magic[8]; // LTRN_MAGIC, zero padded
+	u32 byte_order; // LTRC_BYTE_ORDER, as the writing host stores it
+	u32 num_letters;
+	u64 source_hash; // ltr_hash of the .ltr written with these counts
+	s64 names;
+} ltrn_header; // followed by LTR_COUNTS_CELLS(num_letters) u32 counts
+
+int ltr_counts_new(u8 num_letters, ltr_counts** out)
+{
+	*out = NULL;
+	if ((num_letters < 1) || (num_letters > 28))
+		return LTR_E_LETTERS;
+	ltr_counts* t = calloc(1, sizeof(ltr_counts));
+	if (t == NULL)
+		return LTR_E_ALLOC;
+	t->counts = calloc(LTR_COUNTS_CELLS(num_letters), sizeof(s64));
+	if (t->counts == NULL)
+	{
+		free(t);
+		return LTR_E_ALLOC;
+	}
+	t->num_letters = num_letters;
+	memset(t->letter_of, 0xff, sizeof(t->letter_of));
+	for (u32 i = 0; i < num_letters; i++)
+	{
+		t->letter_of[(u8)ltr_letters[i]] = i;
+		t->letter_of[(u8)toupper(ltr_letters[i])] = i;
+	}
+	*out = t;
+	return LTR_OK;
+}
+
+void ltr_counts_free(ltr_counts* t)
+{
+	if (t == NULL)
+		return;
+	free(t->counts);
+	free(t);
+}
+
+u64 ltr_counts_names(const ltr_counts* t)
+{
+	return t->names;
+}
+
+// count a name weight times (negative to take it back out); returns false,
+// counting nothing, if it has letters outside the alphabet or is too short
+// or too long for a generator to produce
+bool ltr_counts_add(ltr_counts* t, const char* name, u32 len, s32 weight)
+{
+	u8 a[LTR_NAME_MAX];
+	if ((len < COUNT_MIN_NAME) || (len >= LTR_NAME_MAX))
+		return false;
+	for (u32 p = 0; p < len; p++)
+	{
+		a[p] = t->letter_of[(u8)name[p]];
+		if (a[p] == 0xff)
+			return false;
+	}
+	const ltr_counts* l = t; // LTR_DOUBLES and LTR_TRIPLES want num_letters
+	LTR_COUNT(t, LTR_SINGLES, ROW_START, a[0]) += weight;
+	LTR_COUNT(t, LTR_DOUBLES(l,a[0]), ROW_START, a[1]) += weight;
+	LTR_COUNT(t, LTR_TRIPLES(l,a[0],a[1]), ROW_START, a[2]) += weight;
+	for (u32 p = 1; p < len - 1; p++)
+	{
+		LTR_COUNT(t, LTR_SINGLES, ROW_MIDDLE, a[p]) += weight;
+		LTR_COUNT(t, LTR_DOUBLES(l,a[p-1]), ROW_MIDDLE, a[p]) += weight;
+		if (p >= 2)
+			LTR_COUNT(t, LTR_TRIPLES(l,a[p-2],a[p-1]), ROW_MIDDLE, a[p]) += weight;
+	}
+	LTR_COUNT(t, LTR_SINGLES, ROW_END, a[len-1]) += weight;
+	LTR_COUNT(t, LTR_DOUBLES(l,a[len-2]), ROW_END, a[len-1]) += weight;
+	LTR_COUNT(t, LTR_TRIPLES(l,a[len-3],a[len-2]), ROW_END, a[len-1]) += weight;
+	t->names += weight;
+	return true;
+}
+
+// count every line of a block of names; blank lines are ignored, and lines
+// that can't be counted are tallied in skipped
+static void counts_add_lines(ltr_counts* t, const char* p, const char* end, s32 weight, u64* added, u64* skipped)
+{
+	while (p < end)
+	{
+		const char* nl = memchr(p, '\n', end - p);
+		const char* eol = nl ? nl : end;
+		const char* e = eol;
+		while ((e > p) && ((e[-1] == '\r') || (e[-1] == ' ') || (e[-1] == '\t')))
+			e--;
+		if (e > p)
+		{
+			if (ltr_counts_add(t, p, e - p, weight))
+				(*added)++;
+			else
+				(*skipped)++;
+		}
+		p = eol + 1;
+	}
+}
+
+static void counts_merge(ltr_counts* to, const ltr_counts* from)
+{
+	for (u32 i = 0; i < LTR_COUNTS_CELLS(to->num_letters); i++)
+		to->counts[i] += from->counts[i];
+	to->names += from->names;
+}
+
+typedef struct count_worker
+{
+	ltr_counts* t;
+	const char* begin;
+	const char* end;
+	s32 weight;
+	u64 added;
+	u64 skipped;
+} count_worker;
+
+static void* count_run(void* arg)
+{
+	count_worker* w = arg;
+	counts_add_lines(w->t, w->begin, w->end, w->weight, &w->added, &w->skipped);
+	return NULL;
+}
+
+// count a block of names, one per line, on up to threads threads. The
+// block is split at line breaks, each piece counted into its own table, and
+// those added up at the end, so the result doesn't depend on the threads.
+int ltr_counts_add_text(ltr_counts* t, const char* text, size_t len, s32 weight, u32 threads, u64* added, u64* skipped)
+{
+	u32 num_workers = threads ? threads : 1;
+	if (num_workers > (len / COUNT_MIN_CHUNK) + 1)
+		num_workers = (len / COUNT_MIN_CHUNK) + 1;
+	count_worker workers[num_workers];
+	const char* end = text + len;
+	const char* from = text;
+	for (u32 w = 0; w < num_workers; w++)
+	{
+		const char* to = (w + 1 == num_workers) ? end : text + ((len / num_workers) * (w + 1));
+		if (to < from)
+			to = from;
+		if (to < end)
+		{
+			const char* nl = memchr(to, '\n', end - to);
+			to = nl ? nl + 1 : end;
+		}
+		workers[w] = (count_worker){ t, from, to, weight, 0, 0 };
+		from = to;
+		if ((w > 0) && (ltr_counts_new(t->num_letters, &workers[w].t) != LTR_OK))
+		{
+			for (u32 f = 1; f < w; f++)
+				ltr_counts_free(workers[f].t);
+			return LTR_E_ALLOC;
+		}
+	}
+#ifdef HAVE_PTHREAD
+	pthread_t tid[num_workers];
+	bool started[num_workers];
+	for (u32 w = 1; w < num_workers; w++)
+		started[w] = !pthread_create(&tid[w], NULL, count_run, &workers[w]);
+	count_run(&workers[0]);
+	for (u32 w = 1; w < num_workers; w++)
+	{
+		if (started[w])
+			pthread_join(tid[w], NULL);
+		else
+			count_run(&workers[w]);
+	}
+#else
+	for (u32 w = 0; w < num_workers; w++)
+		count_run(&workers[w]);
+#endif
+	for (u32 w = 0; w < num_workers; w++)
+	{
+		if (w > 0)
+		{
+			counts_merge(t, workers[w].t);
+			ltr_counts_free(workers[w].t);
+		}
+		if (added)
+			*added += workers[w].added;
+		if (skipped)
+			*skipped += workers[w].skipped;
+	}
+	return LTR_OK;
+}
+
+// count a file of names, one per line; an empty one adds none
+int ltr_counts_add_file(ltr_counts* t, const char* filename, s32 weight, u32 threads, u64* added, u64* skipped)
+{
+	ltr_opts c = { false, threads, 0 };
+	const u8* data;
+	size_t len;
+	int ret = input_open(filename, c, 0, SIZE_MAX, &data, &len);
+	if (ret != LTR_OK)
+		return ret;
+	ret = ltr_counts_add_text(t, (const char*)data, len, weight, threads, added, skipped);
+	input_release(data, len);
+	return ret;
+}
+
+static void put_f(u8* p, float f)
+{
+	u32 t;
+	memcpy(&t, &f, sizeof(t));
+	p[0] = t; p[1] = t >> 8; p[2] = t >> 16; p[3] = t >> 24;
+}
+
+// write a file through a temporary one, so that it is never seen half written
+static int output_write(const char* filename, const void* a, size_t a_len, const void* b, size_t b_len)
+{
+	char tmpname[4096];
+#ifdef HAVE_MMAP
+	snprintf(tmpname, sizeof(tmpname), "%s.%ld.tmp", filename, (long)getpid());
+#else
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+#endif
+	FILE* out = fopen(tmpname, "wb");
+	if (!out)
+	{
+		eprintf(V_ERR,"E* Unable to open output file %s!\n", tmpname);
+		return LTR_E_WRITE;
+	}
+	bool ok = (fwrite(a, 1, a_len, out) == a_len) && (!b_len || (fwrite(b, 1, b_len, out) == b_len));
+	if (fclose(out) || !ok || rename(tmpname, filename))
+	{
+		eprintf(V_ERR,"E* Unable to write output file %s!\n", filename);
+		remove(tmpname);
+		return LTR_E_WRITE;
+	}
+	return LTR_OK;
+}
+
+// a row's cdf, worked out in double precision from its counts so that it
+// ends at exactly 1.0; letters with no count get 0.0, as Bioware's utility
+// gives them, and so does every letter of an empty row
+static void row_put_cdf(u8* p, const s64* counts, u32 num_letters)
+{
+	s64 total = 0;
+	for (u32 k = 0; k < num_letters; k++)
+		total += counts[k];
+	s64 acc = 0;
+	for (u32 k = 0; k < num_letters; k++, p += sizeof(float))
+	{
+		acc += counts[k];
+		put_f(p, counts[k] ? (float)((double)acc / total) : 0.0f);
+	}
+}
+
+// check that a row's counts fit an .ltr file: none negative, and a total
+// that fits in a cdf_array
+static bool row_counts_valid(const s64* counts, u32 num_letters)
+{
+	s64 total = 0;
+	for (u32 k = 0; k < num_letters; k++)
+	{
+		if (counts[k] < 0)
+			return false;
+		total += counts[k];
+	}
+	return total <= INT32_MAX;
+}
+
+// the start of an .ltr image with room for all of its rows; the caller
+// fills the rows in and frees it
+static u8* ltr_image_alloc(u8 num_letters, size_t* len)
+{
+	*len = 8 + 1 + ((size_t)LTR_COUNTS_CELLS(num_letters) * sizeof(float));
+	u8* image = malloc(*len);
+	if (image)
+	{
+		memcpy(image, "LTR V1.0", 8);
+		image[8] = num_letters;
+	}
+	return image;
+}
+
+// write a counts file keyed by the hash of the .ltr image it goes with
+static int counts_file_write(const ltr_counts* t, const char* countsfile, u64 hash)
+{
+	u32 cells = LTR_COUNTS_CELLS(t->num_letters);
+	u32* counts = malloc((size_t)cells * sizeof(u32));
+	if (counts == NULL)
+		return LTR_E_ALLOC;
+	for (u32 i = 0; i < cells; i++)
+		counts[i] = t->counts[i];
+	ltrn_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, LTRN_MAGIC, sizeof(LTRN_MAGIC));
+	h.byte_order = LTRC_BYTE_ORDER;
+	h.num_letters = t->num_letters;
+	h.source_hash = hash;
+	h.names = t->names;
+	int ret = output_write(countsfile, &h, sizeof(h), counts, (size_t)cells * sizeof(u32));
+	free(counts);
+	return ret;
+}
+
+// write the counts as an .ltr file and, if countsfile isn't NULL, as a
+// counts file for ltr_load_counted
+int ltr_counts_write(const ltr_counts* t, const char* filename, const char* countsfile)
+{
+	for (u32 row = 0; row < LTR_COUNTS_CELLS(t->num_letters); row += t->num_letters)
+	{
+		if (!row_counts_valid(t->counts + row, t->num_letters))
+		{
+			eprintf(V_ERR,"E* The counts are out of range for an .ltr file!\n");
+			return LTR_E_PARAM;
+		}
+	}
+	size_t len;
+	u8* image = ltr_image_alloc(t->num_letters, &len);
+	if (image == NULL)
+		return LTR_E_ALLOC;
+	for (u32 row = 0; row < LTR_COUNTS_CELLS(t->num_letters); row += t->num_letters)
+		row_put_cdf(image + 9 + ((size_t)row * sizeof(float)), t->counts + row, t->num_letters);
+	int ret = output_write(filename, image, len, NULL, 0);
+	if ((ret == LTR_OK) && countsfile)
+		ret = counts_file_write(t, countsfile, ltr_hash(image, len));
+	free(image);
+	return ret;
+}
+
+// read a counts file, checking that it belongs to an .ltr image with the
+// given hash and number of letters
+int ltr_counts_load(const char* countsfile, const u64* hash, ltr_counts** out)
+{
+	ltr_opts c = { false, 1, 0 };
+	const u8* data;
+	size_t len;
+	*out = NULL;
+	int ret = input_open(countsfile, c, sizeof(ltrn_header), sizeof(ltrn_header) + (LTR_COUNTS_CELLS(28) * sizeof(u32)), &data, &len);
+	if (ret != LTR_OK)
+		return ret;
+	ltrn_header h;
+	memcpy(&h, data, sizeof(h));
+	if (memcmp(h.magic, LTRN_MAGIC, sizeof(LTRN_MAGIC)) || (h.byte_order != LTRC_BYTE_ORDER) || (h.num_letters < 1) || (h.num_letters > 28)
+		|| (len != sizeof(h) + (LTR_COUNTS_CELLS(h.num_letters) * sizeof(u32))))
+	{
+		eprintf(V_ERR,"E* %s is not a counts file for this host!\n", countsfile);
+		input_release(data, len);
+		return LTR_E_MAGIC;
+	}
+	if (hash && (h.source_hash != *hash))
+	{
+		eprintf(V_ERR,"E* %s was not written with this .ltr file!\n", countsfile);
+		input_release(data, len);
+		return LTR_E_STALE;
+	}
+	ret = ltr_counts_new(h.num_letters, out);
+	if (ret == LTR_OK)
+	{
+		const u8* p = data + sizeof(h);
+		for (u32 i = 0; i < LTR_COUNTS_CELLS(h.num_letters); i++, p += sizeof(u32))
+		{
+			u32 n;
+			memcpy(&n, p, sizeof(n));
+			(*out)->counts[i] = n;
+		}
+		(*out)->names = h.names;
+	}
+	input_release(data, len);
+	return ret;
+}
+
+// set a stored row's counts, along with its table's total and buckets
+static void row_set_counts(ltrfile* l, u32 table, u32 r, const s64* counts)
+{
+	cdf_array* p = LTR_CDF(l, table);
+	s32* totals[3] = { &p->start_total, &p->middle_total, &p->end_total };
+	s32* buckets[3] = { &p->start_buckets, &p->middle_buckets, &p->end_buckets };
+	f_array* f = LTR_ROW(l, table, r);
+	s64 total = 0;
+	s32 used = 0;
+	for (u32 k = 0; k < l->num_letters; k++)
+	{
+		f[k].count = counts[k];
+		total += counts[k];
+		used += (counts[k] != 0);
+	}
+	*totals[r] = total;
+	*buckets[r] = used;
+}
+
+// check that counts agree with which letters a model's row can pick
+static bool row_counts_fit(const ltrfile* l, u32 table, u32 r, const s64* counts)
+{
+	const f_array* f = LTR_ROW(l, table, r);
+	for (u32 k = 0; k < l->num_letters; k++)
+	{
+		if ((counts[k] != 0) != (f[k].cdf_data != 0.0))
+			return false;
+	}
+	return row_counts_valid(counts, l->num_letters);
+}
+
+// take every row's counts, totals and buckets from t instead of analyzing
+// the floats for them; returns false if t doesn't fit the model
+static bool ltr_apply_counts(ltrfile* l, const ltr_counts* t)
+{
+	if (t->num_letters != l->num_letters)
+		return false;
+	for (u32 table = 0; table < LTR_NUM_TABLES(l->num_letters); table++)
+	{
+		for (u32 r = 0; r < 3; r++)
+		{
+			if (!row_counts_fit(l, table, r, &LTR_COUNT(t, table, r, 0)))
+				return false;
+		}
+	}
+	for (u32 table = 0; table < LTR_NUM_TABLES(l->num_letters); table++)
+	{
+		for (u32 r = 0; r < 3; r++)
+		{
+			// the shared empty row, which the counts agree is empty, stays as it is
+			if (LTR_ROW_INDEX(l, table, r))
+				row_set_counts(l, table, r, &LTR_COUNT(t, table, r, 0));
+		}
+	}
+	return true;
+}
+
+// load an .ltr file using the exact counts written with it by
+// ltr_counts_write, rather than recovering them by analysis
+int ltr_load_counted(const char* filename, const char* countsfile, const ltr_opts* o, ltrfile** out)
+{
+	ltr_opts c = *o;
+	const u8* data;
+	size_t len;
+	*out = NULL;
+	int ret = input_open(filename, c, MINFILESIZE, MAXFILESIZE, &data, &len);
+	if (ret != LTR_OK)
+		return ret;
+	ret = ltr_decode(data, len, out, c);
+	input_release(data, len);
+	if (ret != LTR_OK)
+		return ret;
+	// the decoded model carries the hash of its .ltr image
+	ltr_counts* t = NULL;
+	ret = ltr_counts_load(countsfile, &(*out)->hash, &t);
+	if (ret != LTR_OK)
+	{
+		ltr_free(*out);
+		*out = NULL;
+		return ret;
+	}
+	ltr_fix(*out, c);
+	if (!ltr_apply_counts(*out, t))
+	{
+		eprintf(V_ERR,"E* The counts in %s don't match %s!\n", countsfile, filename);
+		ltr_counts_free(t);
+		ltr_free(*out);
+		*out = NULL;
+		return LTR_E_STALE;
+	}
+	ltr_counts_free(t);
+	if (!c.tables_only && !ltr_build_samplers(*out, c))
+	{
+		ltr_free(*out);
+		*out = NULL;
+		return LTR_E_ALLOC;
+	}
+	eprintf(V_LOAD,"D* loaded %s with the exact counts from %s\n", filename, countsfile);
+	return LTR_OK;
+}
+
+/* incremental updates
+ *
+ * A model already knows the integer counts behind each of its rows, either
+ * recovered by ltr_analyze or read from a counts file, so adding or removing
+ * a few names doesn't need the whole name list again. ltr_update takes the
+ * counts of the names to add (and, counted with a weight of -1, to remove)
+ * and makes a new model in which only the rows those names touch get new
+ * counts and a new cdf; every other row keeps its floats and counts exactly,
+ * and nothing is analyzed. The model it starts from is left alone, so
+ * generators and registries can keep using it meanwhile.
+ *
+ * For a Bioware file the recovered counts are only as good as the analysis:
+ * a row whose counts all share a common factor is recovered divided by it,
+ * so names added to it weigh that much more than they should. A row whose
+ * counts couldn't be recovered at all can't be updated, and gives
+ * LTR_E_COUNTS if the update touches it.
+ */
+
+// check that a stored row's counts were recovered: every letter it can pick
+// has a count
+static bool row_counted(const ltrfile* l, u32 table, u32 r)
+{
+	const f_array* f = LTR_ROW(l, table, r);
+	for (u32 k = 0; k < l->num_letters; k++)
+	{
+		if ((f[k].cdf_data != 0.0) && (f[k].count <= 0))
+			return false;
+	}
+	return true;
+}
+
+static void row_get_counts(const ltrfile* l, u32 table, u32 r, s64* counts)
+{
+	const f_array* f = LTR_ROW(l, table, r);
+	for (u32 k = 0; k < l->num_letters; k++)
+		counts[k] = LTR_ROW_INDEX(l, table, r) ? f[k].count : 0;
+}
+
+// copy a model's row into an .ltr image just as it was loaded
+static void row_put_floats(u8* p, const ltrfile* l, u32 table, u32 r)
+{
+	const f_array* f = LTR_ROW(l, table, r);
+	for (u32 k = 0; k < l->num_letters; k++, p += sizeof(float))
+		put_f(p, f[k].cdf_data);
+}
+
+// the counts of every row of a model, for ltr_counts_write or to add to;
+// gives LTR_E_COUNTS if any of them weren't recovered
+int ltr_counts_from_model(const ltrfile* l, ltr_counts** out)
+{
+	int ret = ltr_counts_new(l->num_letters, out);
+	if (ret != LTR_OK)
+		return ret;
+	for (u32 table = 0; table < LTR_NUM_TABLES(l->num_letters); table++)
+	{
+		for (u32 r = 0; r < 3; r++)
+		{
+			if (!row_counted(l, table, r))
+			{
+				ltr_counts_free(*out);
+				*out = NULL;
+				return LTR_E_COUNTS;
+			}
+			row_get_counts(l, table, r, &LTR_COUNT(*out, table, r, 0));
+		}
+	}
+	(*out)->names = LTR_CDF(l, LTR_SINGLES)->start_total;
+	return LTR_OK;
+}
+
+// write a model as an .ltr file and, if countsfile isn't NULL, its counts
+// as a counts file, so that it loads again without being analyzed
+int ltr_write(const ltrfile* l, const char* filename, const char* countsfile)
+{
+	ltr_counts* t = NULL;
+	if (countsfile)
+	{
+		int ret = ltr_counts_from_model(l, &t);
+		if (ret != LTR_OK)
+			return ret;
+	}
+	size_t len;
+	u8* image = ltr_image_alloc(l->num_letters, &len);
+	if (image == NULL)
+	{
+		ltr_counts_free(t);
+		return LTR_E_ALLOC;
+	}
+	for (u32 table = 0; table < LTR_NUM_TABLES(l->num_letters); table++)
+	{
+		for (u32 r = 0; r < 3; r++)
+			row_put_floats(image + 9 + ((size_t)((table * 3) + r) * l->num_letters * sizeof(float)), l, table, r);
+	}
+	int ret = output_write(filename, image, len, NULL, 0);
+	if ((ret == LTR_OK) && countsfile)
+		ret = counts_file_write(t, countsfile, ltr_hash(image, len));
+	free(image);
+	ltr_counts_free(t);
+	return ret;
+}
+
+// build an updated model's sampling tables. Each row that came unchanged
+// from l, as from[] says, has its tables copied; only the rest are built.
+// The sparse rows and the reach are quick integer passes over the lookup
+// tables, and the reach depends on every row, so those are done whole.
+static bool update_build_samplers(ltrfile* u, const ltrfile* l, const u16* from, ltr_opts c)
+{
+	u32 n = u->num_letters;
+	u->cdf = malloc(u->num_rows * CDF_STRIDE * sizeof(float));
+	u->lut = malloc(u->num_rows * sizeof(lut_row));
+	u->alias = malloc(u->num_rows * n * sizeof(alias_entry));
+	u->cum = malloc(u->num_rows * COUNT_STRIDE * sizeof(u32));
+	if ((u->cdf == NULL) || (u->lut == NULL) || (u->alias == NULL) || (u->cum == NULL))
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for sampling tables!\n");
+		return false;
+	}
+	u32 built = 0;
+	for (u32 r = 0; r < u->num_rows; r++)
+	{
+		if (from[r])
+		{
+			memcpy(u->cdf + (r * CDF_STRIDE), l->cdf + (from[r] * CDF_STRIDE), CDF_STRIDE * sizeof(float));
+			u->lut[r] = l->lut[from[r]];
+			memcpy(u->alias + (r * n), l->alias + (from[r] * n), n * sizeof(alias_entry));
+			memcpy(u->cum + (r * COUNT_STRIDE), l->cum + (from[r] * COUNT_STRIDE), COUNT_STRIDE * sizeof(u32));
+			continue;
+		}
+		f_array* f = u->rows + (r * n);
+		for (u32 i = 0; i < CDF_STRIDE; i++)
+			u->cdf[(r * CDF_STRIDE) + i] = (i < n) ? f[i].cdf_data : 0.0;
+		lut_build_row(u->lut + r, f, n);
+		alias_build_row(u->alias + (r * n), f, n);
+		count_build_row(u->cum + (r * COUNT_STRIDE), f, n);
+		built++;
+	}
+	cdf_search_init();
+	eprintf(V_LOAD,"D* built sampling tables for %u of %u rows\n", built, u->num_rows);
+	return ltr_build_sparse(u, c) && ltr_build_reach(u, c);
+}
+
+// make the updated model from its .ltr image and the new counts of every
+// row: rows that weren't touched are copied from l, and only the touched
+// ones are decoded from the image, exactly as ltr_decode would
+static int update_model(const ltrfile* l, const u8* data, u32 len, const s64* counts, const bool* touched, ltr_opts c, ltrfile** out)
+{
+	u32 num_tables = LTR_NUM_TABLES(l->num_letters);
+	u32 num_rows = 1;
+	for (u32 row = 0; row < num_tables * 3; row++)
+	{
+		if ((row < 3) || (touched[row] ? !row_is_empty(data + 9 + (row * l->num_letters * sizeof(float)), l->num_letters) : (l->row_of[row] != 0)))
+			num_rows++;
+	}
+	ltrfile* u = ltr_alloc(l->num_letters, num_rows);
+	u16* from = calloc(num_rows, sizeof(u16)); // row of l each stored row was copied from, or 0
+	if ((u == NULL) || (from == NULL))
+	{
+		ltr_free(u);
+		free(from);
+		return LTR_E_ALLOC;
+	}
+	u->opts = c;
+	u->hash = ltr_hash(data, len);
+	memcpy(u->magic, data, 8);
+	u32 next = 1;
+	for (u32 t = 0; t < num_tables; t++)
+	{
+		for (u32 r = 0; r < 3; r++)
+		{
+			u32 row = (t * 3) + r;
+			u32 pos = 9 + (row * l->num_letters * sizeof(float));
+			if (!touched[row] && LTR_ROW_INDEX(l, t, r))
+			{
+				from[next] = LTR_ROW_INDEX(l, t, r);
+				LTR_ROW_INDEX(u, t, r) = next++;
+				memcpy(LTR_ROW(u, t, r), LTR_ROW(l, t, r), l->num_letters * sizeof(f_array));
+			}
+			else if (touched[row] && ((t == LTR_SINGLES) || !row_is_empty(data + pos, l->num_letters)))
+			{
+				LTR_ROW_INDEX(u, t, r) = next++;
+				LOAD_LTR_FLOATS(LTR_ROW(u, t, r));
+			}
+			else
+				LTR_ROW_INDEX(u, t, r) = 0;
+		}
+	}
+	ltr_fix(u, c);
+	// untouched rows keep the counts they had, recovered or not
+	for (u32 t = 0; t < num_tables; t++)
+	{
+		for (u32 r = 0; r < 3; r++)
+		{
+			if (LTR_ROW_INDEX(u, t, r))
+				row_set_counts(u, t, r, counts + ((size_t)((t * 3) + r) * l->num_letters));
+		}
+	}
+	bool built = true;
+	if (!c.tables_only)
+		built = l->lut ? update_build_samplers(u, l, from, c) : ltr_build_samplers(u, c);
+	free(from);
+	if (!built)
+	{
+		ltr_free(u);
+		return LTR_E_ALLOC;
+	}
+	*out = u;
+	return LTR_OK;
+}
+
+// make a new model from l with the counts in delta added to it; see above
+int ltr_update(const ltrfile* l, const ltr_counts* delta, const ltr_opts* o, ltrfile** out)
+{
+	ltr_opts c = *o;
+	*out = NULL;
+	if (delta->num_letters != l->num_letters)
+		return LTR_E_LETTERS;
+	u32 num_rows = LTR_NUM_TABLES(l->num_letters) * 3;
+	size_t len;
+	u8* image = ltr_image_alloc(l->num_letters, &len);
+	s64* counts = malloc((size_t)LTR_COUNTS_CELLS(l->num_letters) * sizeof(s64));
+	bool* touched = calloc(num_rows, sizeof(bool));
+	if ((image == NULL) || (counts == NULL) || (touched == NULL))
+	{
+		free(image);
+		free(counts);
+		free(touched);
+		return LTR_E_ALLOC;
+	}
+
+	// the new counts of every row, and the image with the touched rows' cdfs
+	// worked out again from them
+	int ret = LTR_OK;
+	u32 num_touched = 0;
+	for (u32 table = 0; (table < LTR_NUM_TABLES(l->num_letters)) && (ret == LTR_OK); table++)
+	{
+		for (u32 r = 0; r < 3; r++)
+		{
+			u32 row = (table * 3) + r;
+			s64* n = counts + ((size_t)row * l->num_letters);
+			u8* p = image + 9 + ((size_t)row * l->num_letters * sizeof(float));
+			row_get_counts(l, table, r, n);
+			for (u32 k = 0; k < l->num_letters; k++)
+				touched[row] |= (LTR_COUNT(delta, table, r, k) != 0);
+			if (!touched[row])
+			{
+				row_put_floats(p, l, table, r);
+				continue;
+			}
+			num_touched++;
+			if (!row_counted(l, table, r))
+			{
+				eprintf(V_ERR,"E* The counts of a row this update changes couldn't be recovered!\n");
+				ret = LTR_E_COUNTS;
+				break;
+			}
+			for (u32 k = 0; k < l->num_letters; k++)
+				n[k] += LTR_COUNT(delta, table, r, k);
+			if (!row_counts_valid(n, l->num_letters))
+			{
+				eprintf(V_ERR,"E* The update removes names the model doesn't have!\n");
+				ret = LTR_E_PARAM;
+				break;
+			}
+			row_put_cdf(p, n, l->num_letters);
+		}
+	}
+	if (ret == LTR_OK)
+		ret = update_model(l, image, len, counts, touched, c, out);
+	if (ret == LTR_OK)
+		eprintf(V_LOAD,"D* updated %u of %u rows\n", num_touched, num_rows);
+	free(image);
+	free(counts);
+	free(touched);
+	return ret;
+}
+
+/* model registries
+ *
+ * Every registered name is an entry, and every distinct file contents (by
+ * ltr_hash and length) a model that the entries share. Files are hashed when
+ * registered, and checked against the hash again whenever they are loaded.
+ * One lock guards the loaded models, their pins and the recently used
+ * clock; it is never held while a model loads, so a slow load only holds up
+ * whoever is waiting for that same model.
+ */
+#define REGISTRY_NAME_MAX (64)
+
+typedef struct reg_model
+{
+	char* filename; // the first file registered with these contents
+	u64 hash;
+	size_t len;
+	ltrfile* l; // NULL while not loaded
+	size_t bytes; // ltr_model_bytes of l
+	u32 pins; // ltr_registry_get calls not yet matched by ltr_registry_put
+	u64 last_used; // registry clock when last handed out
+	bool loading;
+} reg_model;
+
+typedef struct reg_entry
+{
+	char name[REGISTRY_NAME_MAX];
+	u32 model;
+} reg_entry;
+
+struct ltr_registry
+{
+	ltr_opts c;
+	size_t mem_cap;
+	size_t resident; // bytes of all loaded models
+	u64 clock;
+	reg_entry* entries;
+	u32 num_entries;
+	reg_model* models;
+	u32 num_models;
+	u32 cap; // entries and models allocated; there are never more models than entries
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;
+#endif
+};
+
+static void reg_lock(ltr_registry* r)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&r->lock);
+#endif
+}
+
+static void reg_unlock(ltr_registry* r)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&r->lock);
+#endif
+}
+
+// wait, with the lock held, for some other thread to finish loading a model
+static void reg_wait(ltr_registry* r)
+{
+#ifdef HAVE_PTHREAD
+	pthread_cond_wait(&r->loaded, &r->lock);
+#endif
+}
+
+int ltr_registry_new(const ltr_opts* o, size_t mem_cap, ltr_registry** out)
+{
+	*out = calloc(1, sizeof(ltr_registry));
+	if (*out == NULL)
+		return LTR_E_ALLOC;
+	(*out)->c = *o;
+	(*out)->mem_cap = mem_cap;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&(*out)->lock, NULL);
+	pthread_cond_init(&(*out)->loaded, NULL);
+#endif
+	return LTR_OK;
+}
+
+void ltr_registry_free(ltr_registry* r)
+{
+	if (r == NULL)
+		return;
+	for (u32 m = 0; m < r->num_models; m++)
+	{
+		if (r->models[m].l)
+			ltr_free(r->models[m].l);
+		free(r->models[m].filename);
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->loaded);
+#endif
+	free(r->entries);
+	free(r->models);
+	free(r);
+}
+
+static s32 reg_find(const ltr_registry* r, const char* name)
+{
+	for (u32 e = 0; e < r->num_entries; e++)
+	{
+		if (!strcmp(r->entries[e].name, name))
+			return e;
+	}
+	return -1;
+}
+
+int ltr_registry_add(ltr_registry* r, const char* name, const char* filename)
+{
+	ltr_opts c = r->c;
+	reg_entry e;
+	if (name == NULL)
+	{
+		const char* base = strrchr(filename, '/');
+		base = base ? base + 1 : filename;
+		const char* dot = strrchr(base, '.');
+		size_t n = dot ? (size_t)(dot - base) : strlen(base);
+		if (!n || (n >= REGISTRY_NAME_MAX))
+		{
+			eprintf(V_ERR,"E* Unable to name a model after %s!\n", filename);
+			return LTR_E_PARAM;
+		}
+		memcpy(e.name, base, n);
+		e.name[n] = '\0';
+	}
+	else if (!name[0] || (strlen(name) >= REGISTRY_NAME_MAX))
+	{
+		eprintf(V_ERR,"E* Invalid model name %s!\n", name);
+		return LTR_E_PARAM;
+	}
+	else
+		strcpy(e.name, name);
+	if (reg_find(r, e.name) >= 0)
+	{
+		eprintf(V_ERR,"E* Model name %s is used twice!\n", e.name);
+		return LTR_E_PARAM;
+	}
+
+	const u8* data;
+	size_t len;
+	int ret = input_open(filename, c, MINFILESIZE, MAXFILESIZE, &data, &len);
+	if (ret != LTR_OK)
+		return ret;
+	u64 hash = ltr_hash(data, len);
+	input_release(data, len);
+
+	if (r->num_entries == r->cap)
+	{
+		u32 cap = r->cap ? r->cap * 2 : 32;
+		reg_entry* entries = realloc(r->entries, cap * sizeof(reg_entry));
+		if (entries == NULL)
+			return LTR_E_ALLOC;
+		r->entries = entries;
+		reg_model* models = realloc(r->models, cap * sizeof(reg_model));
+		if (models == NULL)
+			return LTR_E_ALLOC;
+		r->models = models;
+		r->cap = cap;
+	}
+	for (e.model = 0; e.model < r->num_models; e.model++)
+	{
+		if ((r->models[e.model].hash == hash) && (r->models[e.model].len == len))
+			break;
+	}
+	if (e.model == r->num_models)
+	{
+		char* copy = malloc(strlen(filename) + 1);
+		if (copy == NULL)
+			return LTR_E_ALLOC;
+		strcpy(copy, filename);
+		r->models[r->num_models++] = (reg_model){ copy, hash, len, NULL, 0, 0, 0, false };
+	}
+	else
+		eprintf(V_LOAD,"D* %s is the same as %s, and shares its model\n", filename, r->models[e.model].filename);
+	r->entries[r->num_entries++] = e;
+	eprintf(V_LOAD,"D* registered %s as %s\n", filename, e.name);
+	return LTR_OK;
+}
+
+static int cmp_names(const void* a, const void* b)
+{
+	return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// register every .ltr file in a directory, in name order, each under its
+// file name without the .ltr
+int ltr_registry_add_dir(ltr_registry* r, const char* dirname)
+{
+#ifdef HAVE_MMAP
+	DIR* d = opendir(dirname);
+	if (d == NULL)
+	{
+		eprintf(V_ERR,"E* Unable to open directory %s!\n", dirname);
+		return LTR_E_OPEN;
+	}
+	char** names = NULL;
+	u32 num_names = 0, names_cap = 0;
+	int ret = LTR_OK;
+	struct dirent* de;
+	while ((ret == LTR_OK) && ((de = readdir(d)) != NULL))
+	{
+		size_t n = strlen(de->d_name);
+		if ((n <= 4) || (tolower((u8)de->d_name[n-3]) != 'l') || (tolower((u8)de->d_name[n-2]) != 't') || (tolower((u8)de->d_name[n-1]) != 'r') || (de->d_name[n-4] != '.'))
+			continue;
+		if (num_names == names_cap)
+		{
+			names_cap = names_cap ? names_cap * 2 : 32;
+			char** grown = realloc(names, names_cap * sizeof(char*));
+			if (grown == NULL)
+			{
+				ret = LTR_E_ALLOC;
+				break;
+			}
+			names = grown;
+		}
+		names[num_names] = malloc(strlen(dirname) + 1 + n + 1);
+		if (names[num_names] == NULL)
+		{
+			ret = LTR_E_ALLOC;
+			break;
+		}
+		sprintf(names[num_names++], "%s/%s", dirname, de->d_name);
+	}
+	closedir(d);
+	if (num_names)
+		qsort(names, num_names, sizeof(char*), cmp_names);
+	for (u32 i = 0; i < num_names; i++)
+	{
+		if (ret == LTR_OK)
+			ret = ltr_registry_add(r, NULL, names[i]);
+		free(names[i]);
+	}
+	free(names);
+	if ((ret == LTR_OK) && !num_names)
+		eprintf(V_ERR,"W* No .ltr files in %s\n", dirname);
+	return ret;
+#else
+	eprintf(V_ERR,"E* Unable to read directory %s on this platform!\n", dirname);
+	return LTR_E_OPEN;
+#endif
+}
+
+u32 ltr_registry_count(const ltr_registry* r)
+{
+	return r->num_entries;
+}
+
+const char* ltr_registry_name(const ltr_registry* r, u32 i)
+{
+	return r->entries[i].name;
+}
+
+// load a model's file, which must still have the contents it was registered
+// with; called without the lock
+static int reg_load(const reg_model* m, const ltr_opts* o, ltrfile** out)
+{
+	ltr_opts c = *o;
+	const u8* data;
+	size_t len;
+	*out = NULL;
+	int ret = input_open(m->filename, c, MINFILESIZE, MAXFILESIZE, &data, &len);
+	if (ret != LTR_OK)
+		return ret;
+	if ((len != m->len) || (ltr_hash(data, len) != m->hash))
+	{
+		eprintf(V_ERR,"E* %s has changed since it was registered!\n", m->filename);
+		input_release(data, len);
+		return LTR_E_STALE;
+	}
+	ret = ltr_load(data, len, o, out);
+	input_release(data, len);
+	return ret;
+}
+
+// with the lock held, free the least recently used models nobody is using
+// until the loaded ones fit under the cap again
+static void reg_evict(ltr_registry* r)
+{
+	ltr_opts c = r->c;
+	while (r->mem_cap && (r->resident > r->mem_cap))
+	{
+		reg_model* lru = NULL;
+		for (u32 m = 0; m < r->num_models; m++)
+		{
+			reg_model* k = &r->models[m];
+			if (k->l && !k->pins && ((lru == NULL) || (k->last_used < lru->last_used)))
+				lru = k;
+		}
+		if (lru == NULL)
+			return; // everything loaded is in use
+		eprintf(V_LOAD,"D* evicting %s to stay under the memory cap\n", lru->filename);
+		ltr_free(lru->l);
+		lru->l = NULL;
+		r->resident -= lru->bytes;
+	}
+}
+
+// with the lock held, add a freshly loaded model and wake anyone waiting on it
+static void reg_loaded(ltr_registry* r, reg_model* m, ltrfile* l)
+{
+	m->loading = false;
+	if (l)
+	{
+		m->l = l;
+		m->bytes = ltr_model_bytes(l);
+		r->resident += m->bytes;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_cond_broadcast(&r->loaded);
+#endif
+}
+
+// one loader thread of ltr_registry_load_all; takes the next model that
+// isn't loaded, until there are none or the cap is reached
+typedef struct reg_loader
+{
+	ltr_registry* r;
+	ltr_opts o; // with the threads each model may use for its analysis
+	u32 next;
+	int ret;
+} reg_loader;
+
+static void* reg_load_run(void* arg)
+{
+	reg_loader* a = arg;
+	ltr_registry* r = a->r;
+	for (;;)
+	{
+		reg_lock(r);
+		reg_model* m = NULL;
+		while ((m == NULL) && (a->next < r->num_models) && !(r->mem_cap && (r->resident >= r->mem_cap)))
+		{
+			m = &r->models[a->next++];
+			if (m->l || m->loading)
+				m = NULL;
+		}
+		if (m)
+			m->loading = true;
+		reg_unlock(r);
+		if (m == NULL)
+			return NULL;
+		ltrfile* l;
+		int ret = reg_load(m, &a->o, &l);
+		reg_lock(r);
+		reg_loaded(r, m, l);
+		if ((ret != LTR_OK) && (a->ret == LTR_OK))
+			a->ret = ret;
+		reg_unlock(r);
+	}
+}
+
+// load every registered model now, as far as the memory cap allows. The
+// models are loaded side by side on the option's threads, and each model's
+// analysis gets an equal share of them.
+int ltr_registry_load_all(ltr_registry* r)
+{
+	ltr_opts c = r->c;
+	u32 num_threads = c.threads ? c.threads : 1;
+	if (num_threads > r->num_models)
+		num_threads = r->num_models ? r->num_models : 1;
+	reg_loader a = { r, c, 0, LTR_OK };
+	a.o.threads = (c.threads > num_threads) ? (c.threads / num_threads) : 1;
+#ifdef HAVE_PTHREAD
+	pthread_t tid[num_threads];
+	bool started[num_threads];
+	for (u32 t = 1; t < num_threads; t++)
+		started[t] = !pthread_create(&tid[t], NULL, reg_load_run, &a);
+	reg_load_run(&a);
+	for (u32 t = 1; t < num_threads; t++)
+	{
+		if (started[t])
+			pthread_join(tid[t], NULL);
+	}
+#else
+	reg_load_run(&a);
+#endif
+	reg_lock(r);
+	reg_evict(r); // loads already under way when the cap was reached may have overshot it
+	reg_unlock(r);
+	eprintf(V_LOAD,"D* %u names share %u models, taking %zu bytes\n", r->num_entries, r->num_models, r->resident);
+	return a.ret;
+}
+
+// hand out a model by name, loading it if it isn't already; it stays loaded
+// until given back with ltr_registry_put
+int ltr_registry_get(ltr_registry* r, const char* name, const ltrfile** out)
+{
+	*out = NULL;
+	s32 e = reg_find(r, name);
+	if (e < 0)
+		return LTR_E_NOMODEL;
+	reg_model* m = &r->models[r->entries[e].model];
+	reg_lock(r);
+	while (m->loading)
+		reg_wait(r);
+	if (m->l == NULL)
+	{
+		m->loading = true;
+		reg_unlock(r);
+		ltrfile* l;
+		int ret = reg_load(m, &r->c, &l);
+		reg_lock(r);
+		reg_loaded(r, m, l);
+		if (ret != LTR_OK)
+		{
+			reg_unlock(r);
+			return ret;
+		}
+	}
+	m->pins++;
+	m->last_used = ++r->clock;
+	reg_evict(r);
+	*out = m->l;
+	reg_unlock(r);
+	return LTR_OK;
+}
+
+void ltr_registry_put(ltr_registry* r, const ltrfile* l)
+{
+	reg_lock(r);
+	for (u32 m = 0; m < r->num_models; m++)
+	{
+		if ((r->models[m].l == l) && r->models[m].pins)
+		{
+			r->models[m].pins--;
+			break;
+		}
+	}
+	reg_evict(r);
+	reg_unlock(r);
+}
+
+/* generators
+ *
+ * A generator holds everything that changes while generating names from a
+ * model, so the model itself stays read-only.
+ */
+typedef struct gen_chunk gen_chunk;
+typedef struct name_shard name_shard;
+
+struct ltrgen
+{
+	const ltrfile* l;
+	ltr_gen_opts c;
+	ms_rng rng;
+	ltr_gen_stats stats;
+	gen_chunk* chunks; // scratch for ltr_gen_batch, c.threads entries, allocated on first use
+	name_shard* unique; // names handed out so far, UNIQUE_SHARDS entries, or NULL if not in unique mode
+	const ltr_filter* exclude; // names never to hand out in unique mode, or NULL
+	u64 misses; // names in a row thrown away in unique mode
+	bool exhausted; // unique mode gave up on finding new names
+	METRIC(gen_metrics metrics;)
+};
+
+// draw the roll consumed by one ltr_pick
+static u32 ltr_roll(ltrgen* g)
+{
+	if ((g->c.sampler == SAMPLER_ALIAS) || (g->c.sampler == SAMPLER_COUNT))
+	{
+		u32 hi = ms_rand(&g->rng);
+		return (hi << 15) | ms_rand(&g->rng);
+	}
+	return ms_rand(&g->rng);
+}
+
+// pick a letter from row r of table t using a roll from ltr_roll; returns
+// num_letters if the row can't produce a letter for this roll
+static u8 ltr_pick(const ltrfile* l, u32 t, u32 r, u32 roll, u32 sampler)
+{
+	u32 row = LTR_ROW_INDEX(l, t, r);
+	u8 k;
+	if (sampler == SAMPLER_ALIAS)
+	{
+		const alias_entry* a = l->alias + (row * l->num_letters);
+		u64 x = (u64)roll * l->num_letters;
+		k = x >> ALIAS_BITS;
+		return ((x & (ALIAS_ONE - 1)) < a[k].prob) ? k : a[k].alias;
+	}
+	if (sampler == SAMPLER_COUNT)
+	{
+		const u32* cum = l->cum + (row * COUNT_STRIDE);
+		return count_search(cum, l->num_letters, ((u64)roll * cum[l->num_letters - 1]) >> COUNT_BITS);
+	}
+	if (sampler == SAMPLER_LUT)
+	{
+		const lut_row* p = l->lut + row;
+		k = p->base[roll >> LUT_SHIFT];
+		while (p->thresh[k] <= roll)
+			k++;
+		return k;
+	}
+	if (sampler == SAMPLER_SPARSE)
+	{
+		const u32* e = l->sparse + l->sparse_start[row];
+		const u32* end = l->sparse + l->sparse_start[row + 1];
+		for (; e < end; e++)
+		{
+			if (roll < (*e >> 8))
+				return *e & 0xff;
+		}
+		return l->num_letters;
+	}
+	float rng = (float)roll / MSRAND_MAX; // normalize the roll the same way Bioware does
+	return cdf_search(l->cdf + (row * CDF_STRIDE), l->num_letters, rng);
+}
+
+u8 l2offset(u8 in)
+{
+	u8 ret = in - 'a';
+	if (in == '\'') return 26;
+	if (in == '-') return 27;
+	return ret;
+}
+
+// Pruning: a generator with c.prune set never takes a letter that leads to a
+// state which can't end the name in the room left, going by the model's
+// reach tables. Such picks are rolled again instead, and a name that can't go
+// on is ended; so the backtracking and restarting below, which Bioware's
+// generator relies on, only happen if float rounding leaves a row unable to
+// pick. A run of more than PRUNE_MAX rerolls in one name gives up pruning it.
+#define PRUNE_MAX (1000)
+
+// generate exactly one name; see ltr_gen_name
+static u32 ltr_generate(ltrgen* g, char* name)
+{
+	const ltrfile* l = g->l;
+	const ltr_gen_opts c = g->c;
+	u32 index = 0;
+	bool done = false;
+	bool begin = true;
+	u32 roll = 0;
+	u8 i = 0, j = 0, k = 0;
+	s32 failcnt = 0;
+	u32 prunecnt = 0;
+	METRIC(u64 pos = g->rng.pos;)
+	memset(name, 0, LTR_NAME_MAX);
+	tprintf(V_GEN2,"D* generating name...\n");
+	while (!done) // if we're not done yet
+	{
+		tprintf(V_GEN,"D* Current name state is \"%s\"\n", name);
+		// generate the first 3 letters
+		if (begin)
+		{
+			// initialze some variables here
+			failcnt = 0;
+			prunecnt = 0;
+			index = 0;
+			METRIC(g->metrics.start_retries--;) // the first try isn't a retry
+			do
+			{
+				METRIC(g->metrics.start_retries++;)
+				// roll for a starting letter
+				i = ltr_pick(l, LTR_SINGLES, ROW_START, ltr_roll(g), c.sampler);
+
+				if (i >= l->num_letters) // sanity check
+					continue;
+
+				// roll for the second letter
+				j = ltr_pick(l, LTR_DOUBLES(l,i), ROW_START, ltr_roll(g), c.sampler);
+
+				if (j >= l->num_letters) // sanity check
+					continue;
+
+				// roll for the third letter
+				k = ltr_pick(l, LTR_TRIPLES(l,i,j), ROW_START, ltr_roll(g), c.sampler);
+
+				// a start that can't be finished is no better than no start
+				if (c.prune && (k < l->num_letters) && (l->reach[LTR_STATE(l,j,k)] > (LTR_NAME_MAX - 1 - 3)))
+				{
+					g->stats.pruned++;
+					k = l->num_letters;
+				}
+			} while ((i >= l->num_letters) || (j >= l->num_letters) || (k >= l->num_letters)); // sanity check and loop condition in one
+
+			// we did it! shove these 3 letters into a string
+			name[index++] = ltr_letters[i];
+			name[index++] = ltr_letters[j];
+			name[index++] = ltr_letters[k];
+			tprintf(V_GEN,"D* generated 3 first characters %c%c%c\n", ltr_letters[i], ltr_letters[j], ltr_letters[k]);
+			begin = false;
+		}
+		// at this point index is at least 3.
+
+		// make sure k was sane before shifting stuff over
+		if (k < l->num_letters)
+		{
+			i = j;
+			j = k;
+		}
+
+		// roll for another letter for k but don't use it yet
+		roll = ltr_roll(g);
+
+		// roll to see whether the name ends here; names can't be longer than 12+1 letters and should be biased toward shorter names
+		bool end = ((ms_rand(&g->rng) % c.genmaxlen) <= index);
+		s32 room = (LTR_NAME_MAX - 1) - (s32)index; // letters that still fit
+		if (c.prune && !end && (l->reach_middle[LTR_STATE(l,i,j)] > room)) // going on can only lead to a dead end
+		{
+			g->stats.forced_ends++;
+			end = true;
+		}
+		if (end) // did our name end?
+		{
+			k = ltr_pick(l, LTR_TRIPLES(l,i,j), ROW_END, roll, c.sampler); // use the previous letter roll to find an ending triple
+			if (k < l->num_letters)
+			{
+				done = true; // no more letters needed, we just use the ending triple we found directly.
+				// note there may be an original bug here, if k from this roll wasn't sane, we end abruptly?
+				tprintf(V_GEN,"D* rolled to end the name after the next letter\n");
+			}
+		}
+
+		if (!done) // if we're not done yet, we still need more letters.
+		{
+			k = ltr_pick(l, LTR_TRIPLES(l,i,j), ROW_MIDDLE, roll, c.sampler); // use the previous letter roll to find an middle triple
+			if (c.prune && (k < l->num_letters) && (l->reach[LTR_STATE(l,j,k)] > (room - 1)) && (prunecnt < PRUNE_MAX))
+			{
+				tprintf(V_GEN2,"D* rolling again rather than taking %c into a dead end\n", ltr_letters[k]);
+				g->stats.pruned++;
+				prunecnt++;
+				k = l->num_letters; // stay in the same state
+				continue;
+			}
+		}
+
+		if ((k < l->num_letters) && (index < (LTR_NAME_MAX - 1))) // our roll was sane, and there's room for it?
+		{
+			name[index++] = ltr_letters[k];
+			tprintf(V_GEN2,"D* generated another character %c\n", ltr_letters[k]);
+		}
+		else if ((index > 3) && (failcnt < 100)) // no, it wasn't. we may be stuck in an impossible situation, so back up and try again
+		{
+			tprintf(V_GEN2,"D* backing up 1 character after failing a roll\n");
+			// regenerate the old values for i and j
+			j = l2offset(name[index-2]);
+			i = l2offset(name[index-3]);
+			name[index-1] = '\0'; // DEBUG: nuke the character at index-1
+			index--;
+			failcnt++;
+			g->stats.backtracks++;
+			done = false;
+		}
+		else // we're definitely stuck in a bad way. just start over.
+		{
+			tprintf(V_GEN,"D* giving up and starting over\n");
+			index = 0; // DEBUG: set index to 0
+			begin = true;
+			g->stats.restarts++;
+			done = false;
+		}
+	}
+	name[index] = '\0'; // add a trailing null
+	// capitalize the first letter if it is a-z, leave it alone if it is - or '
+	name[0] = toupper(name[0]);
+	g->stats.names++;
+	METRIC(metrics_name(&g->metrics, g->rng.pos - pos, index);)
+	tprintf(V_GEN2,"D* generated name: %s\n", name);
+	return index;
+}
+
+bool ltr_batch_init(ltr_batch* b, size_t chars_cap, u32 names_cap)
+{
+	b->chars = malloc(chars_cap);
+	b->offsets = malloc((names_cap + 1) * sizeof(u32));
+	b->chars_cap = chars_cap;
+	b->names_cap = names_cap;
+	b->count = 0;
+	if ((b->chars == NULL) || (b->offsets == NULL))
+	{
+		free(b->chars);
+		free(b->offsets);
+		return false;
+	}
+	b->offsets[0] = 0;
+	return true;
+}
+
+void ltr_batch_free(ltr_batch* b)
+{
+	free(b->chars);
+	free(b->offsets);
+	b->chars = NULL;
+	b->offsets = NULL;
+}
+
+void ltr_batch_clear(ltr_batch* b)
+{
+	b->count = 0;
+	b->offsets[0] = 0;
+}
+
+// is there room in the batch for one more name of any length?
+static bool ltr_batch_room(const ltr_batch* b)
+{
+	return (b->count < b->names_cap) && ((b->chars_cap - b->offsets[b->count]) >= LTR_NAME_MAX);
+}
+
+// append up to n names to a batch, stopping early if it fills up; returns
+// the number of names added.
+static u32 gen_batch(ltrgen* g, ltr_batch* b, u32 n)
+{
+	u32 made = 0;
+	for (; (made < n) && ltr_batch_room(b); made++)
+	{
+		u32 len = ltr_generate(g, b->chars + b->offsets[b->count]);
+		b->offsets[b->count + 1] = b->offsets[b->count] + len;
+		b->count++;
+	}
+	return made;
+}
+
+/* multithreaded generation
+ *
+ * Every name depends on the rng state left behind by the previous one, so a
+ * batch can't simply be split by name count. Instead each thread starts at an
+ * evenly spaced position in the rng stream (reached with ms_skip) and
+ * generates names from there. That chain is garbage at first, but as soon as
+ * one of its names starts at exactly the same rng position as a name of the
+ * real chain, the two are identical from then on; since both chains advance a
+ * few dozen draws per name, this happens within a handful of names.
+ *
+ * So, after every thread has covered its segment, each thread keeps going into
+ * the next thread's segment until it starts a name at a position the next
+ * thread also started a name at. The real chain is then stitched together
+ * from thread 0 onward, and the output is identical to a serial run no matter
+ * how many threads were used. While they keep going the threads only look at
+ * the name starts each other had at the end of the first phase, which are
+ * copied aside for it, as their own names keep growing meanwhile.
+ */
+#define GEN_MIN_PARALLEL (4096) // don't bother with threads below this many names
+
+struct gen_chunk
+{
+	ltrgen gen; // copy of the parent generator, whose rng starts at the chunk
+	u64 stop; // phase 1 stops before starting a name at or past this position
+	ltr_batch names;
+	u64* starts; // rng position each name started at, names.names_cap entries
+	u64* seen; // copy of starts at the end of phase 1, for the other chunks to search in phase 2
+	u32 seen_count;
+	u32 seen_cap;
+	struct gen_chunk* chunks; // all of the chunks of this round
+	u32 index; // of this chunk
+	u32 num_chunks;
+	u32 next; // chunk this one's chain runs into, or num_chunks if none
+	u32 next_from; // index of the first name in that chunk belonging to this chain
+	bool ok;
+};
+
+// generate one name onto the end of a chunk, growing it as needed
+static bool gen_chunk_add(gen_chunk* g)
+{
+	ltr_batch* b = &g->names;
+	if (!ltr_batch_room(b))
+	{
+		u32 names_cap = b->names_cap;
+		size_t chars_cap = b->chars_cap;
+		if (b->count >= names_cap)
+			names_cap *= 2;
+		else
+			chars_cap *= 2;
+		char* chars = realloc(b->chars, chars_cap);
+		if (chars == NULL)
+			return false;
+		b->chars = chars;
+		b->chars_cap = chars_cap;
+		u32* offsets = realloc(b->offsets, (names_cap + 1) * sizeof(u32));
+		if (offsets == NULL)
+			return false;
+		b->offsets = offsets;
+		u64* starts = realloc(g->starts, names_cap * sizeof(u64));
+		if (starts == NULL)
+			return false;
+		g->starts = starts;
+		b->names_cap = names_cap;
+	}
+	g->starts[b->count] = g->gen.rng.pos;
+	gen_batch(&g->gen, b, 1);
+	return true;
+}
+
+// find the phase 1 name of a chunk that started at some rng position
+static s32 gen_chunk_find(const gen_chunk* g, u64 pos)
+{
+	s32 lo = 0, hi = (s32)g->seen_count - 1;
+	while (lo <= hi)
+	{
+		s32 mid = (lo + hi) / 2;
+		if (g->seen[mid] == pos)
+			return mid;
+		if (g->seen[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+// phase 1: cover this chunk's segment of the rng stream
+static void* gen_chunk_phase1(void* arg)
+{
+	gen_chunk* g = arg;
+	g->ok = true;
+	while (g->gen.rng.pos < g->stop)
+	{
+		if (!gen_chunk_add(g))
+		{
+			g->ok = false;
+			break;
+		}
+	}
+	if (g->names.count > g->seen_cap)
+	{
+		u64* seen = realloc(g->seen, g->names.count * sizeof(u64));
+		if (seen == NULL)
+		{
+			g->ok = false;
+			g->seen_count = 0;
+			return NULL;
+		}
+		g->seen = seen;
+		g->seen_cap = g->names.count;
+	}
+	memcpy(g->seen, g->starts, g->names.count * sizeof(u64));
+	g->seen_count = g->names.count;
+	return NULL;
+}
+
+// phase 2: keep going until this chain runs into a later chunk's chain
+static void* gen_chunk_phase2(void* arg)
+{
+	gen_chunk* g = arg;
+	u32 u = g->index + 1;
+	while (g->ok && (u < g->num_chunks))
+	{
+		const gen_chunk* n = &g->chunks[u];
+		s32 found = gen_chunk_find(n, g->gen.rng.pos);
+		if (found >= 0)
+		{
+			g->next_from = found;
+			break;
+		}
+		// if we've passed every name of that chunk, it never joined the
+		// real chain and we have to cover for it
+		if (!n->seen_count || (g->gen.rng.pos > n->seen[n->seen_count-1]))
+		{
+			u++;
+			continue;
+		}
+		if (!gen_chunk_add(g))
+			g->ok = false;
+	}
+	g->next = u;
+	return NULL;
+}
+
+// run a phase over every chunk, in threads where possible
+static void gen_run(gen_chunk* chunks, u32 num_chunks, void* (*fn)(void*))
+{
+#ifdef HAVE_PTHREAD
+	pthread_t tid[num_chunks];
+	bool started[num_chunks];
+	for (u32 t = 1; t < num_chunks; t++)
+		started[t] = !pthread_create(&tid[t], NULL, fn, &chunks[t]);
+	fn(&chunks[0]);
+	for (u32 t = 1; t < num_chunks; t++)
+	{
+		if (started[t])
+			pthread_join(tid[t], NULL);
+		else
+			fn(&chunks[t]);
+	}
+#else
+	for (u32 t = 0; t < num_chunks; t++)
+		fn(&chunks[t]);
+#endif
+}
+
+// allocate the per-thread scratch used by ltr_gen_batch
+static bool gen_chunks_alloc(ltrgen* g)
+{
+	u32 num_chunks = g->c.threads;
+	g->chunks = calloc(num_chunks, sizeof(gen_chunk));
+	if (g->chunks == NULL)
+		return false;
+	for (u32 t = 0; t < num_chunks; t++)
+	{
+		if (!ltr_batch_init(&g->chunks[t].names, 1 << 16, 1 << 12) || !(g->chunks[t].starts = malloc((1 << 12) * sizeof(u64))))
+			return false;
+		if (!(g->chunks[t].seen = malloc((1 << 12) * sizeof(u64))))
+			return false;
+		g->chunks[t].seen_cap = 1 << 12;
+	}
+	return true;
+}
+
+static void gen_chunks_free(ltrgen* g)
+{
+	if (g->chunks == NULL)
+		return;
+	for (u32 t = 0; t < g->c.threads; t++)
+	{
+		ltr_batch_free(&g->chunks[t].names);
+		free(g->chunks[t].starts);
+		free(g->chunks[t].seen);
+	}
+	free(g->chunks);
+	g->chunks = NULL;
+}
+
+// append up to n names to a batch using up to c.threads threads, ignoring
+// unique mode; see ltr_gen_batch
+static u32 gen_batch_stream(ltrgen* g, ltr_batch* b, u32 n)
+{
+	const ltr_gen_opts c = g->c;
+	u32 num_chunks = c.threads;
+	ms_rng* rng = &g->rng;
+	u64 drawn = rng->pos;
+	// a serial prefix, which also tells us how many draws a name takes
+	u32 made = gen_batch(g, b, ((num_chunks < 2) || (n < GEN_MIN_PARALLEL)) ? n : GEN_MIN_PARALLEL);
+	if ((made == n) || !ltr_batch_room(b))
+		return made;
+	if ((g->chunks == NULL) && !gen_chunks_alloc(g))
+	{
+		gen_chunks_free(g);
+		return made;
+	}
+
+	gen_chunk* chunks = g->chunks;
+	while ((made < n) && ltr_batch_room(b))
+	{
+		// spread the rest evenly over the rng stream; there's no point going
+		// past what the batch can hold
+		u32 want = n - made;
+		if (want > (b->names_cap - b->count))
+			want = b->names_cap - b->count;
+		double per_name = (double)(rng->pos - drawn) / made;
+		u64 span = (u64)((per_name * want) / num_chunks) + 1;
+		ms_rng base = *rng;
+		for (u32 t = 0; t < num_chunks; t++)
+		{
+			gen_chunk* h = &chunks[t];
+			h->gen = *g;
+			h->gen.chunks = NULL;
+			memset(&h->gen.stats, 0, sizeof(ltr_gen_stats));
+			METRIC(memset(&h->gen.metrics, 0, sizeof(gen_metrics));)
+			ms_skip(&h->gen.rng, span * t);
+			h->stop = base.pos + (span * (t + 1));
+			ltr_batch_clear(&h->names);
+			h->chunks = chunks;
+			h->index = t;
+			h->num_chunks = num_chunks;
+			h->next = num_chunks;
+			h->next_from = 0;
+		}
+		gen_run(chunks, num_chunks, gen_chunk_phase1);
+		gen_run(chunks, num_chunks - 1, gen_chunk_phase2);
+		for (u32 t = 0; t < num_chunks; t++)
+		{
+			const ltr_gen_stats* s = &chunks[t].gen.stats;
+			g->stats.names += s->names;
+			g->stats.backtracks += s->backtracks;
+			g->stats.restarts += s->restarts;
+			g->stats.pruned += s->pruned;
+			g->stats.forced_ends += s->forced_ends;
+			METRIC(metrics_add(&g->metrics, &chunks[t].gen.metrics);)
+		}
+		// stitch the real chain together, starting from chunk 0 which began
+		// exactly where the serial chain left off
+		for (u32 t = 0, from = 0; t < num_chunks; )
+		{
+			gen_chunk* h = &chunks[t];
+			if (!h->ok)
+				return made;
+			u32 i;
+			for (i = from; (i < h->names.count) && (made < n) && ltr_batch_room(b); i++, made++)
+			{
+				u32 len = h->names.offsets[i+1] - h->names.offsets[i];
+				memcpy(b->chars + b->offsets[b->count], h->names.chars + h->names.offsets[i], len);
+				b->offsets[b->count + 1] = b->offsets[b->count] + len;
+				b->count++;
+			}
+			if (i < h->names.count) // stopped early, so pick up at the start of the next name
+			{
+				*rng = base;
+				ms_skip(rng, h->starts[i] - base.pos);
+				break;
+			}
+			if (h->next >= num_chunks)
+			{
+				*rng = h->gen.rng;
+				break;
+			}
+			from = h->next_from;
+			t = h->next;
+		}
+		tprintf(V_GEN,"D* parallel round done, %d names left\n", n - made);
+	}
+	return made;
+}
+
+// whether a pruned generator can start any name at all; if not, it would
+// roll for a start forever
+static bool ltr_can_start(const ltrfile* l)
+{
+	u32 r1 = LTR_ROW_INDEX(l, LTR_SINGLES, ROW_START);
+	for (u32 a = l->sparse_start[r1]; a < l->sparse_start[r1 + 1]; a++)
+	{
+		u8 i = l->sparse[a] & 0xff;
+		u32 r2 = LTR_ROW_INDEX(l, LTR_DOUBLES(l,i), ROW_START);
+		for (u32 b = l->sparse_start[r2]; b < l->sparse_start[r2 + 1]; b++)
+		{
+			u8 j = l->sparse[b] & 0xff;
+			u32 r3 = LTR_ROW_INDEX(l, LTR_TRIPLES(l,i,j), ROW_START);
+			for (u32 e = l->sparse_start[r3]; e < l->sparse_start[r3 + 1]; e++)
+			{
+				if (l->reach[LTR_STATE(l, j, l->sparse[e] & 0xff)] <= (LTR_NAME_MAX - 1 - 3))
+					return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* unique names
+ *
+ * In unique mode a generator only hands out names it hasn't handed out
+ * before and that aren't in its exclusion filter. The names handed out are
+ * kept in a set split into UNIQUE_SHARDS shards by hash, each an open
+ * addressing table of offsets into the shard's own store of names. A freshly
+ * generated run of names is checked by threads that each own every
+ * num_threads-th shard and go through the run in order, so there is no
+ * locking, and of several equal names the first always wins: the output is
+ * the same for any number of threads, just as it is outside of unique mode.
+ */
+#define UNIQUE_SHARDS       (64)
+#define UNIQUE_PATIENCE     (1 << 22) // names in a row thrown away before deciding the model has run out
+#define UNIQUE_MIN_PARALLEL (4096) // don't bother with threads below this many names
+
+struct name_shard
+{
+	u32* slots; // offset + 1 of each name in chars, or 0 if empty
+	u32 mask; // number of slots - 1
+	u32 count;
+	char* chars; // the names, each after a length byte
+	size_t chars_len;
+	size_t chars_cap;
+};
+
+// FNV-1a like ltr_hash, but ignoring case and with the bits mixed well
+// enough that the top ones can pick the shard
+static u64 name_hash(const char* name, u32 len)
+{
+	u64 h = 0xcbf29ce484222325ULL;
+	for (u32 i = 0; i < len; i++)
+		h = (h ^ (u8)tolower((u8)name[i])) * 0x100000001b3ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+#define NAME_SHARD(h) ((u32)((h) >> 58))
+
+// whether two names of len letters are the same, ignoring case like name_hash
+static bool name_eq(const char* a, const char* b, u32 len)
+{
+	for (u32 i = 0; i < len; i++)
+	{
+		if (tolower((u8)a[i]) != tolower((u8)b[i]))
+			return false;
+	}
+	return true;
+}
+
+// add a name to a shard; returns 1 if it is new, 0 if it was already there
+// and -1 if out of memory
+static int shard_add(name_shard* s, const char* name, u32 len, u64 h)
+{
+	if (((s->count + 1) * 4) > ((s->mask + 1) * 3))
+	{
+		u32 mask = s->slots ? (s->mask * 2) + 1 : 1023;
+		u32* slots = calloc(mask + 1, sizeof(u32));
+		if (slots == NULL)
+			return -1;
+		for (u32 i = 0; s->slots && (i <= s->mask); i++)
+		{
+			if (!s->slots[i])
+				continue;
+			const char* e = s->chars + s->slots[i] - 1;
+			u32 j = name_hash(e + 1, (u8)e[0]) & mask;
+			while (slots[j])
+				j = (j + 1) & mask;
+			slots[j] = s->slots[i];
+		}
+		free(s->slots);
+		s->slots = slots;
+		s->mask = mask;
+	}
+	u32 i = h & s->mask;
+	for (; s->slots[i]; i = (i + 1) & s->mask)
+	{
+		const char* e = s->chars + s->slots[i] - 1;
+		if (((u8)e[0] == len) && name_eq(e + 1, name, len))
+			return 0;
+	}
+	if ((s->chars_len + len + 1) > s->chars_cap)
+	{
+		size_t cap = s->chars_cap ? s->chars_cap * 2 : (1 << 14);
+		char* chars = (cap < 0xffffffffu) ? realloc(s->chars, cap) : NULL;
+		if (chars == NULL)
+			return -1;
+		s->chars = chars;
+		s->chars_cap = cap;
+	}
+	s->slots[i] = s->chars_len + 1;
+	s->chars[s->chars_len] = len;
+	memcpy(s->chars + s->chars_len + 1, name, len);
+	s->chars_len += len + 1;
+	s->count++;
+	return 1;
+}
+
+/* exclusion filters
+ *
+ * A Bloom filter: num_hashes bits are set for each name, picked by double
+ * hashing of name_hash, and a name whose bits are all set is taken to be in
+ * the filter. It never misses a name that was added, and wrongly claims one
+ * that wasn't with about the chance it was sized for.
+ */
+struct ltr_filter
+{
+	u64* bits;
+	u64 num_bits;
+	u32 num_hashes;
+	u64 count;
+};
+
+int ltr_filter_new(u64 expected, double fp_rate, ltr_filter** out)
+{
+	*out = NULL;
+	if (!(fp_rate > 0.0) || !(fp_rate < 1.0))
+		return LTR_E_PARAM;
+	if (expected < 1)
+		expected = 1;
+	double bits = ceil(-(double)expected * log(fp_rate) / (log(2.0) * log(2.0)));
+	ltr_filter* f = malloc(sizeof(ltr_filter));
+	if (f == NULL)
+		return LTR_E_ALLOC;
+	f->num_bits = (((u64)bits + 63) / 64) * 64;
+	f->num_hashes = (u32)((bits / expected * log(2.0)) + 0.5);
+	if (f->num_hashes < 1)
+		f->num_hashes = 1;
+	if (f->num_hashes > 30)
+		f->num_hashes = 30;
+	f->count = 0;
+	f->bits = calloc(f->num_bits / 64, sizeof(u64));
+	if (f->bits == NULL)
+	{
+		free(f);
+		return LTR_E_ALLOC;
+	}
+	*out = f;
+	return LTR_OK;
+}
+
+void ltr_filter_free(ltr_filter* f)
+{
+	if (f == NULL)
+		return;
+	free(f->bits);
+	free(f);
+}
+
+static void filter_add_hash(ltr_filter* f, u64 h)
+{
+	u64 step = (h >> 32) | (h << 32) | 1;
+	for (u32 i = 0; i < f->num_hashes; i++, h += step)
+	{
+		u64 bit = h % f->num_bits;
+		f->bits[bit / 64] |= (u64)1 << (bit % 64);
+	}
+	f->count++;
+}
+
+static bool filter_has_hash(const ltr_filter* f, u64 h)
+{
+	u64 step = (h >> 32) | (h << 32) | 1;
+	for (u32 i = 0; i < f->num_hashes; i++, h += step)
+	{
+		u64 bit = h % f->num_bits;
+		if (!(f->bits[bit / 64] & ((u64)1 << (bit % 64))))
+			return false;
+	}
+	return true;
+}
+
+// add a name to a filter; case is ignored
+void ltr_filter_add(ltr_filter* f, const char* name)
+{
+	filter_add_hash(f, name_hash(name, strlen(name)));
+}
+
+// whether a name is (probably) in a filter
+bool ltr_filter_has(const ltr_filter* f, const char* name)
+{
+	return filter_has_hash(f, name_hash(name, strlen(name)));
+}
+
+// read the next line of a name list, returning its length without the
+// trailing whitespace, or -1 at the end. A line too long to be a generated
+// name returns 0, like a blank one, and the rest of it is skipped rather
+// than read as more lines.
+#define FILTER_LINE (256)
+static int filter_line(FILE* in, char* line)
+{
+	if (!fgets(line, FILTER_LINE, in))
+		return -1;
+	size_t len = strlen(line);
+	if ((!len || (line[len - 1] != '\n')) && !feof(in))
+	{
+		int ch;
+		while (((ch = getc(in)) != EOF) && (ch != '\n'))
+			;
+		return 0;
+	}
+	while (len && isspace((u8)line[len - 1]))
+		len--;
+	return (len < LTR_NAME_MAX) ? (int)len : 0;
+}
+
+// build a filter from a file of names, one per line
+int ltr_filter_load(const char* filename, double fp_rate, ltr_filter** out)
+{
+	char line[FILTER_LINE];
+	u64 lines = 0;
+	int len;
+	*out = NULL;
+	FILE* in = fopen(filename, "r");
+	if (!in)
+		return LTR_E_OPEN;
+	while ((len = filter_line(in, line)) >= 0)
+		lines += (len > 0);
+	int ret = ltr_filter_new(lines, fp_rate, out);
+	rewind(in);
+	while ((ret == LTR_OK) && ((len = filter_line(in, line)) >= 0))
+	{
+		if (len)
+			filter_add_hash(*out, name_hash(line, len));
+	}
+	if ((ret == LTR_OK) && ferror(in))
+	{
+		ltr_filter_free(*out);
+		*out = NULL;
+		ret = LTR_E_OPEN;
+	}
+	fclose(in);
+	return ret;
+}
+
+// one thread of a unique check; worker w of n owns every n-th shard
+typedef struct unique_worker
+{
+	ltrgen* g;
+	const ltr_batch* b;
+	u32 from; // first name of the run
+	const u64* hashes;
+	u8* keep; // 1 to keep, 0 if a duplicate, 2 if excluded
+	u32 w;
+	u32 n;
+	bool ok;
+} unique_worker;
+
+static void* unique_check(void* arg)
+{
+	unique_worker* a = arg;
+	const ltr_batch* b = a->b;
+	a->ok = true;
+	for (u32 i = a->from; i < b->count; i++)
+	{
+		u64 h = a->hashes[i - a->from];
+		if ((NAME_SHARD(h) % a->n) != a->w)
+			continue;
+		if (a->g->exclude && filter_has_hash(a->g->exclude, h))
+		{
+			a->keep[i - a->from] = 2;
+			continue;
+		}
+		int r = shard_add(&a->g->unique[NAME_SHARD(h)], b->chars + b->offsets[i], b->offsets[i+1] - b->offsets[i], h);
+		if (r < 0)
+		{
+			a->ok = false;
+			break;
+		}
+		a->keep[i - a->from] = r;
+	}
+	return NULL;
+}
+
+// drop the names of a batch from name from onward that were handed out
+// before or are excluded; returns the number kept, or -1 if out of memory,
+// in which case the whole run is dropped
+static s32 unique_filter(ltrgen* g, ltr_batch* b, u32 from)
+{
+	const ltr_gen_opts c = g->c;
+	u32 run = b->count - from;
+	u64* hashes = malloc(run * sizeof(u64));
+	u8* keep = malloc(run);
+	if (!hashes || !keep)
+	{
+		free(hashes);
+		free(keep);
+		b->count = from;
+		return -1;
+	}
+	for (u32 i = from; i < b->count; i++)
+		hashes[i - from] = name_hash(b->chars + b->offsets[i], b->offsets[i+1] - b->offsets[i]);
+	u32 num_workers = (run < UNIQUE_MIN_PARALLEL) ? 1 : (c.threads > UNIQUE_SHARDS) ? UNIQUE_SHARDS : c.threads;
+	unique_worker workers[num_workers];
+	for (u32 w = 0; w < num_workers; w++)
+		workers[w] = (unique_worker){ g, b, from, hashes, keep, w, num_workers, false };
+#ifdef HAVE_PTHREAD
+	pthread_t tid[num_workers];
+	bool started[num_workers];
+	for (u32 w = 1; w < num_workers; w++)
+		started[w] = !pthread_create(&tid[w], NULL, unique_check, &workers[w]);
+	unique_check(&workers[0]);
+	for (u32 w = 1; w < num_workers; w++)
+	{
+		if (started[w])
+			pthread_join(tid[w], NULL);
+		else
+			unique_check(&workers[w]);
+	}
+#else
+	for (u32 w = 0; w < num_workers; w++)
+		unique_check(&workers[w]);
+#endif
+	bool ok = true;
+	for (u32 w = 0; w < num_workers; w++)
+		ok = ok && workers[w].ok;
+	free(hashes);
+	if (!ok)
+	{
+		free(keep);
+		b->count = from;
+		return -1;
+	}
+	// squeeze the kept names together
+	u32 kept = from;
+	u32 start = b->offsets[from];
+	for (u32 i = from; i < b->count; i++)
+	{
+		u32 s = start, e = b->offsets[i+1];
+		start = e;
+		if (keep[i - from] != 1)
+		{
+			if (keep[i - from])
+				g->stats.excluded++;
+			else
+				g->stats.duplicates++;
+			g->misses++;
+			continue;
+		}
+		memmove(b->chars + b->offsets[kept], b->chars + s, e - s);
+		b->offsets[kept + 1] = b->offsets[kept] + (e - s);
+		kept++;
+		g->misses = 0;
+	}
+	free(keep);
+	b->count = kept;
+	return kept - from;
+}
+
+// generate runs of names until enough of them are new
+static u32 gen_batch_unique(ltrgen* g, ltr_batch* b, u32 n)
+{
+	const ltr_gen_opts c = g->c;
+	u32 made = 0;
+	while ((made < n) && !g->exhausted)
+	{
+		u32 from = b->count;
+		if (!gen_batch_stream(g, b, n - made))
+			break; // the batch is full
+		s32 kept = unique_filter(g, b, from);
+		if (kept < 0)
+			break;
+		made += kept;
+		if (g->misses >= UNIQUE_PATIENCE)
+		{
+			tprintf(V_GEN,"D* no new names in the last %llu, giving up\n", (unsigned long long)g->misses);
+			g->exhausted = true;
+		}
+	}
+	return made;
+}
+
+// put a generator in unique mode: from now on it only hands out names it
+// hasn't before and, if exclude is not NULL, that aren't in exclude, which
+// must outlive the generator
+int ltr_gen_unique(ltrgen* g, const ltr_filter* exclude)
+{
+	if (g->unique == NULL)
+	{
+		g->unique = calloc(UNIQUE_SHARDS, sizeof(name_shard));
+		if (g->unique == NULL)
+			return LTR_E_ALLOC;
+	}
+	g->exclude = exclude;
+	return LTR_OK;
+}
+
+// whether a generator in unique mode has given up on finding new names,
+// after UNIQUE_PATIENCE names in a row that it had to throw away
+bool ltr_gen_exhausted(const ltrgen* g)
+{
+	return g->exhausted;
+}
+
+// append up to n names to a batch using up to c.threads threads, stopping
+// early if it fills up or, in unique mode, runs out of new names; returns the
+// number of names added. The names and the rng state afterwards are exactly
+// the same no matter how many threads are used.
+u32 ltr_gen_batch(ltrgen* g, ltr_batch* b, u32 n)
+{
+	METRIC(u64 t = ltr_clock_ns();)
+	u32 made = g->unique ? gen_batch_unique(g, b, n) : gen_batch_stream(g, b, n);
+	METRIC(g->metrics.generate_ns += ltr_clock_ns() - t;)
+	return made;
+}
+
+int ltr_gen_new(const ltrfile* l, const ltr_gen_opts* o, u32 seed, ltrgen** out)
+{
+	*out = NULL;
+	if ((o->genmaxlen < 1) || (o->sampler > SAMPLER_COUNT) || (l->lut == NULL))
+		return LTR_E_PARAM;
+	if (o->prune && !ltr_can_start(l))
+		return LTR_E_DEAD;
+	ltrgen* g = malloc(sizeof(ltrgen));
+	if (g == NULL)
+		return LTR_E_ALLOC;
+	g->l = l;
+	g->c = *o;
+	if (g->c.threads < 1)
+		g->c.threads = 1;
+	g->chunks = NULL;
+	g->unique = NULL;
+	g->exclude = NULL;
+	g->misses = 0;
+	g->exhausted = false;
+	memset(&g->stats, 0, sizeof(ltr_gen_stats));
+	METRIC(memset(&g->metrics, 0, sizeof(gen_metrics));)
+	ms_srand(&g->rng, seed);
+	*out = g;
+	return LTR_OK;
+}
+
+void ltr_gen_free(ltrgen* g)
+{
+#ifdef LTR_METRICS
+	METRICS_LOCK();
+	metrics.generators++;
+	metrics.stats.names += g->stats.names;
+	metrics.stats.backtracks += g->stats.backtracks;
+	metrics.stats.restarts += g->stats.restarts;
+	metrics.stats.pruned += g->stats.pruned;
+	metrics.stats.forced_ends += g->stats.forced_ends;
+	metrics.stats.duplicates += g->stats.duplicates;
+	metrics.stats.excluded += g->stats.excluded;
+	metrics_add(&metrics.gen, &g->metrics);
+	METRICS_UNLOCK();
+#endif
+	gen_chunks_free(g);
+	for (u32 s = 0; g->unique && (s < UNIQUE_SHARDS); s++)
+	{
+		free(g->unique[s].slots);
+		free(g->unique[s].chars);
+	}
+	free(g->unique);
+	free(g);
+}
+
+// the generator's rng, which can be copied, jumped, saved or restored
+ms_rng* ltr_gen_rng(ltrgen* g)
+{
+	return &g->rng;
+}
+
+// the generator's running totals
+void ltr_gen_get_stats(const ltrgen* g, ltr_gen_stats* s)
+{
+	*s = g->stats;
+}
+
+// see ltr_gen_name
+static u32 gen_name(ltrgen* g, char* name)
+{
+	if (g->unique == NULL)
+		return ltr_generate(g, name);
+	while (!g->exhausted)
+	{
+		u32 len = ltr_generate(g, name);
+		u64 h = name_hash(name, len);
+		if (g->exclude && filter_has_hash(g->exclude, h))
+			g->stats.excluded++;
+		else
+		{
+			int r = shard_add(&g->unique[NAME_SHARD(h)], name, len, h);
+			if (r < 0)
+				break;
+			if (r)
+			{
+				g->misses = 0;
+				return len;
+			}
+			g->stats.duplicates++;
+		}
+		if (++g->misses >= UNIQUE_PATIENCE)
+			g->exhausted = true;
+	}
+	name[0] = '\0';
+	return 0;
+}
+
+// generate exactly one name into name, which must hold at least LTR_NAME_MAX
+// bytes; returns the length of the name, which is 0 only if a generator in
+// unique mode has run out of new names or memory.
+u32 ltr_gen_name(ltrgen* g, char* name)
+{
+	METRIC(u64 t = ltr_clock_ns();)
+	u32 len = gen_name(g, name);
+	METRIC(g->metrics.generate_ns += ltr_clock_ns() - t;)
+	return len;
+}
+
+// write a batch out as one name per line, gathered a block at a time so
+// that stdio sees a handful of big writes. The block is on the stack, so
+// threads can write batches at once.
+#define WRITE_BATCH_BLOCK (1 << 15)
+bool ltr_write_batch(const ltr_batch* b, FILE* out)
+{
+	char buf[WRITE_BATCH_BLOCK];
+	size_t len = 0;
+	for (u32 i = 0; i < b->count; i++)
+	{
+		u32 n = b->offsets[i+1] - b->offsets[i];
+		if ((len + n + 1) > sizeof(buf))
+		{
+			if (fwrite(buf, 1, len, out) != len)
+				return false;
+			len = 0;
+		}
+		memcpy(buf + len, b->chars + b->offsets[i], n);
+		len += n;
+		buf[len++] = '\n';
+	}
+	return fwrite(buf, 1, len, out) == len;
+}
+
+
+/* name probabilities
+ *
+ * Every step of ltr_generate past the first three letters depends only on
+ * the last two letters (the state) and the name's length (the index), so
+ * how likely a name is can be worked out exactly. From a state at some
+ * index, each step either ends the name with some letter (e), takes a middle
+ * letter to a longer name (m), or fails (f) and backs out of the state's
+ * last letter, or starts over at index 3. Taking a letter and later backing
+ * out of it leads to the same state as before, so if U is the chance of
+ * eventually backing out of a state, going on to a longer name and never
+ * coming back happens with m * (1 - U(next)), and
+ *   U = f / (1 - sum over letters of m * U(next))
+ * gives U for every state and index, working back from the longest name.
+ * A name's chance is then its start's chance times m / (1 - ...) for each of
+ * its middle letters, and e / (1 - ...) for its last one.
+ *
+ * This describes the cdf, lut and sparse samplers without pruning; the limit
+ * of 100 backtracks per name is not modeled, which only matters for states
+ * that are left and come back to nearly every time.
+ */
+#define PROB_ROLLS   (MSRAND_MAX + 1)
+#define PROB_INDEXES (LTR_NAME_MAX - 3) // indexes 3..LTR_NAME_MAX-1
+
+struct ltr_prob
+{
+	const ltrfile* l;
+	ltr_gen_opts c;
+	double* end; // chance each state's end row picks each letter, num_letters entries per state
+	double* middle; // same for the middle row
+	double* middle_tail; // chance of a roll the end row can't use and the middle row picks each letter with
+	double* up; // U of each state at each index, PROB_INDEXES entries per state
+	double* scale; // 1 / (1 - sum of m * U(next)) of each state at each index
+	double* start; // chance of each starting triple, counting rerolls and starting over
+	double end_chance[LTR_NAME_MAX]; // chance of rolling to end the name at each index
+};
+
+#define PROB_AT(p,s,index) (((s) * PROB_INDEXES) + ((index) - 3))
+
+// the chance of each letter a row picks, and with tail set, only counting
+// rolls of at least tail
+static void prob_row(const ltrfile* l, u32 t, u32 r, u32 tail, double* out)
+{
+	const lut_row* p = l->lut + LTR_ROW_INDEX(l, t, r);
+	for (u32 k = 0, prev = 0; k < l->num_letters; k++)
+	{
+		u32 lo = (prev > tail) ? prev : tail;
+		out[k] = (p->thresh[k] > lo) ? (double)(p->thresh[k] - lo) / PROB_ROLLS : 0.0;
+		prev = p->thresh[k];
+	}
+}
+
+// chance of taking middle letter x from state s at index
+static double prob_middle(const ltr_prob* p, u32 s, u32 index, u8 x)
+{
+	u32 n = p->l->num_letters;
+	double pe = p->end_chance[index];
+	return ((1.0 - pe) * p->middle[(s * n) + x]) + (pe * p->middle_tail[(s * n) + x]);
+}
+
+void ltr_prob_free(ltr_prob* p)
+{
+	if (p == NULL)
+		return;
+	free(p->end);
+	free(p->middle);
+	free(p->middle_tail);
+	free(p->up);
+	free(p->scale);
+	free(p->start);
+	free(p);
+}
+
+int ltr_prob_new(const ltrfile* l, const ltr_gen_opts* o, ltr_prob** out)
+{
+	const ltr_gen_opts c = *o;
+	*out = NULL;
+	if ((c.genmaxlen < 1) || (c.sampler == SAMPLER_ALIAS) || (c.sampler > SAMPLER_SPARSE) || c.prune)
+		return LTR_E_PARAM;
+	if (l->lut == NULL)
+		return LTR_E_PARAM;
+	u32 n = l->num_letters;
+	ltr_prob* p = calloc(1, sizeof(ltr_prob));
+	if (p == NULL)
+		return LTR_E_ALLOC;
+	p->l = l;
+	p->c = c;
+	p->end = malloc(n * n * n * sizeof(double));
+	p->middle = malloc(n * n * n * sizeof(double));
+	p->middle_tail = malloc(n * n * n * sizeof(double));
+	p->up = malloc(n * n * PROB_INDEXES * sizeof(double));
+	p->scale = malloc(n * n * PROB_INDEXES * sizeof(double));
+	p->start = malloc(n * n * n * sizeof(double));
+	if (!p->end || !p->middle || !p->middle_tail || !p->up || !p->scale || !p->start)
+	{
+		ltr_prob_free(p);
+		return LTR_E_ALLOC;
+	}
+
+	// the end roll is (ms_rand % genmaxlen) <= index
+	for (u32 index = 3; index < LTR_NAME_MAX; index++)
+	{
+		u32 hits = 0;
+		for (u32 res = 0; (res <= index) && (res < c.genmaxlen); res++)
+			hits += (PROB_ROLLS / c.genmaxlen) + (res < (PROB_ROLLS % c.genmaxlen));
+		p->end_chance[index] = (double)hits / PROB_ROLLS;
+	}
+	// a roll the end row can't use falls through to the middle row
+	for (u32 i = 0; i < n; i++)
+	{
+		for (u32 j = 0; j < n; j++)
+		{
+			u32 s = LTR_STATE(l,i,j);
+			u32 t = LTR_TRIPLES(l,i,j);
+			prob_row(l, t, ROW_END, 0, p->end + (s * n));
+			prob_row(l, t, ROW_MIDDLE, 0, p->middle + (s * n));
+			prob_row(l, t, ROW_MIDDLE, l->lut[LTR_ROW_INDEX(l, t, ROW_END)].thresh[n - 1], p->middle_tail + (s * n));
+		}
+	}
+	// U and the scale, from the longest name back; nothing fits past
+	// LTR_NAME_MAX - 1 letters, so every step there fails
+	for (u32 index = LTR_NAME_MAX - 1; index >= 3; index--)
+	{
+		for (u32 s = 0; s < n * n; s++)
+		{
+			double* up = p->up + PROB_AT(p, s, index);
+			double* scale = p->scale + PROB_AT(p, s, index);
+			if (index == LTR_NAME_MAX - 1)
+			{
+				*up = *scale = 1.0;
+				continue;
+			}
+			double taken = 0.0, back = 0.0;
+			for (u32 k = 0; k < n; k++)
+				taken += p->end_chance[index] * p->end[(s * n) + k];
+			for (u8 x = 0; x < n; x++)
+			{
+				double m = prob_middle(p, s, index, x);
+				taken += m;
+				back += m * p->up[PROB_AT(p, ((s % n) * n) + x, index + 1)];
+			}
+			double fail = (taken < 1.0) ? 1.0 - taken : 0.0;
+			if (back < 1.0)
+			{
+				*up = fail / (1.0 - back);
+				*scale = 1.0 / (1.0 - back);
+			}
+			else // never ends; only the backtrack limit gets out of here
+			{
+				*up = 1.0;
+				*scale = 0.0;
+			}
+		}
+	}
+	// a start that fails is rolled again, and so is one that backs out of
+	// its third letter, so only starts that eventually finish count
+	double singles[28], doubles[28], triples[28];
+	double total = 0.0;
+	prob_row(l, LTR_SINGLES, ROW_START, 0, singles);
+	for (u32 i = 0; i < n; i++)
+	{
+		prob_row(l, LTR_DOUBLES(l,i), ROW_START, 0, doubles);
+		for (u32 j = 0; j < n; j++)
+		{
+			prob_row(l, LTR_TRIPLES(l,i,j), ROW_START, 0, triples);
+			for (u32 k = 0; k < n; k++)
+			{
+				double r = singles[i] * doubles[j] * triples[k];
+				p->start[(((i * n) + j) * n) + k] = r;
+				total += r * (1.0 - p->up[PROB_AT(p, LTR_STATE(l,j,k), 3)]);
+			}
+		}
+	}
+	if (!(total > 0.0))
+	{
+		ltr_prob_free(p);
+		return LTR_E_DEAD;
+	}
+	for (u32 t = 0; t < n * n * n; t++)
+		p->start[t] /= total;
+	tprintf(V_GEN,"D* name probabilities ready, %g of starts finish\n", total);
+	*out = p;
+	return LTR_OK;
+}
+
+// the exact chance of a generator producing a name, ignoring case; 0 if it
+// never can
+double ltr_prob_name(const ltr_prob* p, const char* name)
+{
+	const ltrfile* l = p->l;
+	u32 n = l->num_letters;
+	u32 len = strlen(name);
+	u8 c[LTR_NAME_MAX];
+	if ((len < 4) || (len > LTR_NAME_MAX - 1))
+		return 0.0;
+	for (u32 i = 0; i < len; i++)
+	{
+		const char* f = name[i] ? strchr(ltr_letters, tolower((u8)name[i])) : NULL;
+		if ((f == NULL) || ((u32)(f - ltr_letters) >= n))
+			return 0.0;
+		c[i] = f - ltr_letters;
+	}
+	double prob = p->start[(((c[0] * n) + c[1]) * n) + c[2]];
+	for (u32 index = 3; (index < len) && (prob > 0.0); index++)
+	{
+		u32 s = LTR_STATE(l, c[index-2], c[index-1]);
+		prob *= p->scale[PROB_AT(p, s, index)];
+		if (index == len - 1)
+			prob *= p->end_chance[index] * p->end[(s * n) + c[index]];
+		else
+			prob *= prob_middle(p, s, index, c[index]);
+	}
+	return prob;
+}
+
+/* top names
+ *
+ * Best-first search over name prefixes: a prefix is ranked by the chance of
+ * the finished name starting with it, which no single name under it can
+ * beat, and a finished name by its own chance, so finished names come off
+ * the queue most likely first. Prefixes that can't beat the k-th best name
+ * found so far are dropped. The starting triples are split between threads,
+ * each finding its own best k, and the results are merged. The chances of
+ * the names every thread finds also go into a shared set of the best k, so
+ * that each thread drops prefixes against the k-th best name overall.
+ */
+#define PROB_SYNC (256) // prefixes a thread expands between looks at the shared floor
+
+typedef struct prob_node
+{
+	double bound; // chance of the finished name starting with this prefix, or of this name if done
+	double path; // chance of getting to this prefix
+	u8 len;
+	bool done;
+	char name[LTR_NAME_MAX];
+} prob_node;
+
+typedef struct prob_heap
+{
+	prob_node* v;
+	u32 count;
+	u32 cap;
+} prob_heap;
+
+// the order names come out in: more likely first, then alphabetically
+static bool prob_before(const prob_node* a, const prob_node* b)
+{
+	if (a->bound != b->bound)
+		return a->bound > b->bound;
+	return strcmp(a->name, b->name) < 0;
+}
+
+static bool prob_heap_push(prob_heap* h, const prob_node* x)
+{
+	if (h->count == h->cap)
+	{
+		u32 cap = h->cap ? h->cap * 2 : 1024;
+		prob_node* v = realloc(h->v, cap * sizeof(prob_node));
+		if (v == NULL)
+			return false;
+		h->v = v;
+		h->cap = cap;
+	}
+	u32 i = h->count++;
+	while (i && prob_before(x, &h->v[(i - 1) / 2]))
+	{
+		h->v[i] = h->v[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	h->v[i] = *x;
+	return true;
+}
+
+static prob_node prob_heap_pop(prob_heap* h)
+{
+	prob_node top = h->v[0];
+	prob_node last = h->v[--h->count];
+	u32 i = 0;
+	for (;;)
+	{
+		u32 c = (i * 2) + 1;
+		if (c >= h->count)
+			break;
+		if (((c + 1) < h->count) && prob_before(&h->v[c + 1], &h->v[c]))
+			c++;
+		if (!prob_before(&h->v[c], &last))
+			break;
+		h->v[i] = h->v[c];
+		i = c;
+	}
+	if (h->count)
+		h->v[i] = last;
+	return top;
+}
+
+// chances of the best k finished names seen so far, as a min-heap, for the
+// bound below which prefixes are dropped
+typedef struct prob_floor
+{
+	double* v;
+	u32 count;
+	u32 k;
+	double shared; // best floor of every thread, as of the last sync
+} prob_floor;
+
+static void prob_floor_add(prob_floor* f, double x)
+{
+	if ((f->count == f->k) && (x <= f->v[0]))
+		return;
+	u32 i;
+	if (f->count < f->k)
+		i = f->count++;
+	else // replace the smallest
+	{
+		i = 0;
+		for (;;)
+		{
+			u32 c = (i * 2) + 1;
+			if (c >= f->count)
+				break;
+			if (((c + 1) < f->count) && (f->v[c + 1] < f->v[c]))
+				c++;
+			if (f->v[c] >= x)
+				break;
+			f->v[i] = f->v[c];
+			i = c;
+		}
+		f->v[i] = x;
+		return;
+	}
+	while (i && (x < f->v[(i - 1) / 2]))
+	{
+		f->v[i] = f->v[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	f->v[i] = x;
+}
+
+static double prob_floor_get(const prob_floor* f)
+{
+	double own = (f->count == f->k) ? f->v[0] : 0.0;
+	return (own > f->shared) ? own : f->shared;
+}
+
+typedef struct prob_shared
+{
+	prob_floor f; // of the names every thread has found
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+} prob_shared;
+
+// names a thread has found but not yet told the others about
+typedef struct prob_pending
+{
+	double* v;
+	u32 count;
+	u32 cap;
+} prob_pending;
+
+// hand this thread's new names to the others and pick up their floor
+static void prob_floor_sync(prob_floor* f, prob_pending* q, prob_shared* sh)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&sh->lock);
+#endif
+	for (u32 i = 0; i < q->count; i++)
+		prob_floor_add(&sh->f, q->v[i]);
+	f->shared = prob_floor_get(&sh->f);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&sh->lock);
+#endif
+	q->count = 0;
+}
+
+typedef struct prob_worker
+{
+	const ltr_prob* p;
+	prob_shared* shared;
+	u32 k;
+	u32 w;
+	u32 num_workers;
+	ltr_ranked_name* found; // k entries
+	u32 num_found;
+	u64 expanded;
+	bool ok;
+} prob_worker;
+
+static bool prob_offer(prob_heap* h, prob_floor* f, prob_pending* q, const prob_node* x)
+{
+	if (!(x->bound > 0.0) || (x->bound < prob_floor_get(f)))
+		return true;
+	if (x->done)
+	{
+		prob_floor_add(f, x->bound);
+		if (q->count == q->cap)
+		{
+			u32 cap = q->cap ? q->cap * 2 : 256;
+			double* v = realloc(q->v, cap * sizeof(double));
+			if (v == NULL)
+				return false;
+			q->v = v;
+			q->cap = cap;
+		}
+		q->v[q->count++] = x->bound;
+	}
+	return prob_heap_push(h, x);
+}
+
+static void* prob_search(void* arg)
+{
+	prob_worker* a = arg;
+	const ltr_prob* p = a->p;
+	const ltrfile* l = p->l;
+	u32 n = l->num_letters;
+	prob_heap h = { NULL, 0, 0 };
+	prob_floor f = { malloc(a->k * sizeof(double)), 0, a->k, 0.0 };
+	prob_pending q = { NULL, 0, 0 };
+	a->ok = (f.v != NULL);
+	a->num_found = 0;
+	a->expanded = 0;
+	for (u32 t = a->w; a->ok && (t < n * n * n); t += a->num_workers)
+	{
+		u8 i = t / (n * n), j = (t / n) % n, k = t % n;
+		prob_node x = { 0.0, p->start[t], 3, false, { ltr_letters[i], ltr_letters[j], ltr_letters[k] } };
+		x.bound = x.path * (1.0 - p->up[PROB_AT(p, LTR_STATE(l,j,k), 3)]);
+		a->ok = prob_offer(&h, &f, &q, &x);
+	}
+	while (a->ok && h.count && (a->num_found < a->k))
+	{
+		prob_node x = prob_heap_pop(&h);
+		if (x.bound < prob_floor_get(&f))
+			break; // everything left is worse than the k-th best name
+		if (x.done)
+		{
+			ltr_ranked_name* r = &a->found[a->num_found++];
+			memcpy(r->name, x.name, LTR_NAME_MAX);
+			r->name[0] = toupper(r->name[0]);
+			r->prob = x.bound;
+			continue;
+		}
+		if (!(++a->expanded % PROB_SYNC))
+			prob_floor_sync(&f, &q, a->shared);
+		u32 index = x.len;
+		u32 s = LTR_STATE(l, l2offset(x.name[index-2]), l2offset(x.name[index-1]));
+		double path = x.path * p->scale[PROB_AT(p, s, index)];
+		if (index >= LTR_NAME_MAX - 1)
+			continue;
+		for (u8 c = 0; a->ok && (c < n); c++)
+		{
+			prob_node y = x;
+			y.name[index] = ltr_letters[c];
+			y.len = index + 1;
+			// end with c
+			y.done = true;
+			y.bound = y.path = path * p->end_chance[index] * p->end[(s * n) + c];
+			a->ok = prob_offer(&h, &f, &q, &y);
+			// or go on with it
+			y.done = false;
+			y.path = path * prob_middle(p, s, index, c);
+			y.bound = (index + 1 < LTR_NAME_MAX - 1) ? y.path * (1.0 - p->up[PROB_AT(p, LTR_STATE(l, l2offset(x.name[index-1]), c), index + 1)]) : 0.0;
+			if (a->ok)
+				a->ok = prob_offer(&h, &f, &q, &y);
+		}
+	}
+	free(h.v);
+	free(f.v);
+	free(q.v);
+	return NULL;
+}
+
+static int cmp_ranked(const void* a, const void* b)
+{
+	const ltr_ranked_name* x = a;
+	const ltr_ranked_name* y = b;
+	if (x->prob != y->prob)
+		return (x->prob > y->prob) ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+// find the k most likely names, most likely first, using up to c.threads
+// threads; out must hold k entries. found is set to the number of names
+// found, which is less than k only if the model can't produce that many.
+int ltr_prob_top(const ltr_prob* p, u32 k, ltr_ranked_name* out, u32* found)
+{
+	const ltr_gen_opts c = p->c;
+	u32 n = p->l->num_letters;
+	*found = 0;
+	if (k == 0)
+		return LTR_OK;
+	u32 num_workers = c.threads ? c.threads : 1;
+	if (num_workers > n * n * n)
+		num_workers = n * n * n;
+	prob_worker workers[num_workers];
+	ltr_ranked_name* all = malloc((size_t)num_workers * k * sizeof(ltr_ranked_name));
+	if (all == NULL)
+		return LTR_E_ALLOC;
+	prob_shared shared = { { malloc(k * sizeof(double)), 0, k, 0.0 } };
+	if (shared.f.v == NULL)
+	{
+		free(all);
+		return LTR_E_ALLOC;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&shared.lock, NULL);
+#endif
+	for (u32 w = 0; w < num_workers; w++)
+		workers[w] = (prob_worker){ p, &shared, k, w, num_workers, all + ((size_t)w * k), 0, 0, false };
+#ifdef HAVE_PTHREAD
+	pthread_t tid[num_workers];
+	bool started[num_workers];
+	for (u32 w = 1; w < num_workers; w++)
+		started[w] = !pthread_create(&tid[w], NULL, prob_search, &workers[w]);
+	prob_search(&workers[0]);
+	for (u32 w = 1; w < num_workers; w++)
+	{
+		if (started[w])
+			pthread_join(tid[w], NULL);
+		else
+			prob_search(&workers[w]);
+	}
+	pthread_mutex_destroy(&shared.lock);
+#else
+	for (u32 w = 0; w < num_workers; w++)
+		prob_search(&workers[w]);
+#endif
+	free(shared.f.v);
+	// pack every worker's names together and keep the best k
+	u32 total = 0;
+	u64 expanded = 0;
+	bool ok = true;
+	for (u32 w = 0; w < num_workers; w++)
+	{
+		memmove(all + total, workers[w].found, workers[w].num_found * sizeof(ltr_ranked_name));
+		total += workers[w].num_found;
+		expanded += workers[w].expanded;
+		ok = ok && workers[w].ok;
+	}
+	if (!ok)
+	{
+		free(all);
+		return LTR_E_ALLOC;
+	}
+	qsort(all, total, sizeof(ltr_ranked_name), cmp_ranked);
+	*found = (total < k) ? total : k;
+	memcpy(out, all, *found * sizeof(ltr_ranked_name));
+	free(all);
+	tprintf(V_GEN,"D* found the top %d names, expanding %llu prefixes\n", *found, (unsigned long long)expanded);
+	return LTR_OK;
+}
@@ -0,0 +1,347 @@
+// license:BSD-3-Clause
+// copyright-holders:Jonathan Gevaryahu
+// (C) 2020-2022 Jonathan Gevaryahu AKA Lord Nightmare
+#ifndef NWN_LTR_H
+#define NWN_LTR_H
+
+/* libnwnltr: load, analyze and generate names from Bioware .ltr files
+ *
+ * A model (ltrfile) is loaded, fixed, analyzed and has all of its sampling
+ * tables built by ltr_load/ltr_load_file, and is never modified afterwards,
+ * so any number of threads can share one without locking. Everything that
+ * changes while generating (the random generator, limits and scratch space)
+ * lives in a generator (ltrgen); use one generator per thread.
+ *
+ * Nothing in the library calls exit(); failures are reported through the
+ * LTR_E_* return codes, and diagnostics go to stderr according to the
+ * verbose bitmask in the options.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// basic typedefs
+typedef int8_t s8;
+typedef uint8_t u8;
+typedef int16_t s16;
+typedef uint16_t u16;
+typedef int32_t s32;
+typedef uint32_t u32;
+typedef int64_t s64;
+typedef uint64_t u64;
+
+// the letters an .ltr file can use, in table order
+#define LTR_LETTERS "abcdefghijklmnopqrstuvwxyz'-"
+
+// return codes
+#define LTR_OK          (0)
+#define LTR_E_OPEN      (1) // unable to open, stat, map or read the input file
+#define LTR_E_SIZE      (2) // input size is outside of MINFILESIZE..MAXFILESIZE
+#define LTR_E_MAGIC     (3) // input does not start with "LTR V1.0"
+#define LTR_E_LETTERS   (4) // number of letters is not within 1..28
+#define LTR_E_TRUNCATED (5) // input is too short for the number of letters it claims
+#define LTR_E_ALLOC     (6) // out of memory
+#define LTR_E_PARAM     (7) // invalid option
+#define LTR_E_WRITE     (8) // unable to write the output file
+#define LTR_E_STALE     (9) // compiled model or counts file is from another build, source .ltr or set of options
+#define LTR_E_DEAD     (10) // model can't produce any name
+#define LTR_E_NOMODEL  (11) // no model is registered by that name
+#define LTR_E_COUNTS   (12) // the model's integer counts couldn't be recovered
+
+// verbosity bits for the verbose member of the options; errors are always shown
+#define LTR_V_PARAM (1<<0)
+#define LTR_V_GEN   (1<<1)
+#define LTR_V_GEN2  (1<<2)
+#define LTR_V_FIX   (1<<3)
+#define LTR_V_FIX2  (1<<4)
+#define LTR_V_LOAD  (1<<5)
+#define LTR_V_LOAD2 (1<<6)
+#define LTR_V_FREE  (1<<7)
+#define LTR_V_MATH  (1<<8)
+
+// verbosity bits that are built in at all; building with LTR_V_COMPILED set
+// to fewer of them (make V_COMPILED=...) leaves the rest's diagnostics out
+// entirely, so that they cost nothing
+#ifndef LTR_V_COMPILED
+#define LTR_V_COMPILED (0xffffffffu)
+#endif
+
+// verbosity defines; V_ERR is effectively 'always'. These expect a 'c' with a
+// verbose member to be in scope.
+#define V_ERR   (1)
+#define V_PARAM (c.verbose & LTR_V_PARAM & LTR_V_COMPILED)
+#define V_GEN   (c.verbose & LTR_V_GEN & LTR_V_COMPILED)
+#define V_GEN2  (c.verbose & LTR_V_GEN2 & LTR_V_COMPILED)
+#define V_FIX   (c.verbose & LTR_V_FIX & LTR_V_COMPILED)
+#define V_FIX2  (c.verbose & LTR_V_FIX2 & LTR_V_COMPILED)
+#define V_LOAD  (c.verbose & LTR_V_LOAD & LTR_V_COMPILED)
+#define V_LOAD2 (c.verbose & LTR_V_LOAD2 & LTR_V_COMPILED)
+#define V_FREE  (c.verbose & LTR_V_FREE & LTR_V_COMPILED)
+#define V_MATH  (c.verbose & LTR_V_MATH & LTR_V_COMPILED)
+
+// verbose macro
+#define eprintf(v, ...) \
+	do { if (v) { fprintf(stderr, __VA_ARGS__); fflush(stderr); } } while (0)
+
+// size of the buffer a single name is generated into
+#define LTR_NAME_MAX (64)
+
+// sampler modes for generators
+#define SAMPLER_CDF   (0) // linear scan of cdf_data; reproduces Bioware's names for a given seed
+#define SAMPLER_ALIAS (1) // O(1) alias tables built from the recovered counts; not seed-compatible
+#define SAMPLER_LUT   (2) // per-row lookup tables indexed by the 15-bit roll; identical output to SAMPLER_CDF
+#define SAMPLER_SPARSE (3) // scan of only the letters each row can pick; identical output to SAMPLER_CDF
+#define SAMPLER_COUNT (4) // integer thresholds of the recovered counts; exact count/total odds, no floats, not seed-compatible
+
+// options for loading a model
+typedef struct ltr_opts
+{
+	bool fix; // correct the corrupt singles tables some files have
+	u32 threads; // threads the table analysis may use; 0 is the same as 1
+	u32 verbose; // LTR_V_* bitmask
+	bool tables_only; // skip the sampling tables: the model can be written, updated or counted, but not generate names
+} ltr_opts;
+
+// options for a generator
+typedef struct ltr_gen_opts
+{
+	u32 genmaxlen; // names are biased to be shorter than this; must be at least 1
+	u32 sampler; // SAMPLER_*
+	bool prune; // never walk into a state that can't end the name; faster on sparse models, but not seed compatible
+	u32 threads; // threads ltr_gen_batch may use
+	u32 verbose; // LTR_V_* bitmask
+} ltr_gen_opts;
+
+/* msrand implementation for consistency */
+#define MSRAND_MAX 0x7fff
+
+// each generator carries its own state, so several can run side by side.
+// An ms_rng is plain data, so copying it is enough to save and restore it.
+typedef struct ms_rng
+{
+	u32 state;
+	u64 pos; // number of values drawn since seeding
+} ms_rng;
+
+u32 ms_rand(ms_rng* r);
+void ms_srand(ms_rng* r, u32 seed);
+void ms_skip(ms_rng* r, u64 n);
+void ms_rewind(ms_rng* r, u64 n);
+void ms_jump(ms_rng* r, s64 n);
+void ms_fill(ms_rng* r, u32* out, u32 n);
+bool ms_rng_save(const ms_rng* r, FILE* out);
+bool ms_rng_restore(ms_rng* r, FILE* in);
+/* end msrand */
+
+/* batch generation
+ *
+ * An ltr_batch is a caller-owned block of names: chars holds them back to
+ * back with no separators or terminators, and name i is the offsets[i+1] -
+ * offsets[i] bytes starting at chars + offsets[i]. Generating into one needs
+ * no allocation per name.
+ */
+typedef struct ltr_batch
+{
+	char* chars;
+	size_t chars_cap;
+	u32* offsets; // names_cap + 1 entries
+	u32 names_cap;
+	u32 count; // names in the batch
+} ltr_batch;
+
+bool ltr_batch_init(ltr_batch* b, size_t chars_cap, u32 names_cap);
+void ltr_batch_free(ltr_batch* b);
+void ltr_batch_clear(ltr_batch* b);
+bool ltr_write_batch(const ltr_batch* b, FILE* out);
+
+// models
+typedef struct ltrfile ltrfile;
+
+const char* ltr_strerror(int err);
+int ltr_load(const u8* data, u32 len, const ltr_opts* o, ltrfile** out);
+int ltr_load_file(const char* filename, const ltr_opts* o, ltrfile** out);
+void ltr_free(ltrfile* l);
+u8 ltr_num_letters(const ltrfile* l);
+void ltr_print(const ltrfile* l, int printcdf, FILE* out);
+void ltr_dumpstart(const ltrfile* l, FILE* out);
+
+/* compiled models
+ *
+ * A compiled model (.ltrc) holds a loaded model exactly as it is laid out in
+ * memory, so loading one needs no parsing or analysis, and the file is used
+ * in place through a read-only mapping shared by every process that loads it.
+ * It is keyed by ltr_hash of the source .ltr and by the fix option, and is
+ * only valid for the build and host that wrote it. ltr_load_cached does the
+ * bookkeeping: it uses the cache when it matches and rewrites it when not.
+ */
+u64 ltr_hash(const u8* data, size_t len);
+int ltr_save_compiled(const ltrfile* l, const char* filename);
+int ltr_load_compiled(const char* filename, const u64* hash, const ltr_opts* o, ltrfile** out);
+int ltr_load_cached(const char* filename, const char* cachefile, const ltr_opts* o, ltrfile** out);
+
+/* training
+ *
+ * An ltr_counts tallies how often each letter starts, continues and ends a
+ * name after each letter and pair of letters: the integer counts an .ltr
+ * file's probabilities come from. Names can be counted one at a time or a
+ * whole list at once, spread over threads, and the result written as a new
+ * .ltr file. A counts file written alongside it lets ltr_load_counted use
+ * the exact counts instead of recovering them from the file's floats.
+ */
+typedef struct ltr_counts ltr_counts;
+
+int ltr_counts_new(u8 num_letters, ltr_counts** out);
+void ltr_counts_free(ltr_counts* t);
+u64 ltr_counts_names(const ltr_counts* t);
+bool ltr_counts_add(ltr_counts* t, const char* name, u32 len, s32 weight);
+int ltr_counts_add_text(ltr_counts* t, const char* text, size_t len, s32 weight, u32 threads, u64* added, u64* skipped);
+int ltr_counts_add_file(ltr_counts* t, const char* filename, s32 weight, u32 threads, u64* added, u64* skipped);
+int ltr_counts_write(const ltr_counts* t, const char* filename, const char* countsfile);
+int ltr_counts_load(const char* countsfile, const u64* hash, ltr_counts** out);
+int ltr_load_counted(const char* filename, const char* countsfile, const ltr_opts* o, ltrfile** out);
+
+/* incremental updates
+ *
+ * ltr_update makes a new model from an existing one with the counts of
+ * some names added; names counted with a weight of -1 are taken back out.
+ * Only the rows those names touch get new counts and cdfs, and nothing is
+ * analyzed, and the sampling tables of the rows that didn't change are
+ * copied, so a small change costs far less than training or loading from
+ * scratch. The existing model is not changed. ltr_write saves a model as an
+ * .ltr file, and optionally a counts file for ltr_load_counted; a model
+ * that is only going to be written can be loaded and updated with
+ * tables_only set.
+ */
+int ltr_counts_from_model(const ltrfile* l, ltr_counts** out);
+int ltr_update(const ltrfile* l, const ltr_counts* delta, const ltr_opts* o, ltrfile** out);
+int ltr_write(const ltrfile* l, const char* filename, const char* countsfile);
+
+/* model registries
+ *
+ * A registry holds any number of models by name, such as a directory of
+ * .ltr files for every race and gender. Files with identical contents are
+ * loaded only once, however many names refer to them. ltr_registry_load_all
+ * loads everything up front, several models at a time; otherwise a model is
+ * loaded the first time it is asked for. With a memory cap, the least
+ * recently used models that are not in use are freed to stay under it, and
+ * are loaded again when next asked for.
+ *
+ * Register every model before sharing the registry between threads; after
+ * that, ltr_registry_get and ltr_registry_put can be called from any thread.
+ * A model returned by ltr_registry_get is read-only and stays loaded until
+ * the matching ltr_registry_put.
+ */
+typedef struct ltr_registry ltr_registry;
+
+int ltr_registry_new(const ltr_opts* o, size_t mem_cap, ltr_registry** out); // mem_cap in bytes; 0 for no cap
+void ltr_registry_free(ltr_registry* r);
+int ltr_registry_add(ltr_registry* r, const char* name, const char* filename); // a NULL name is the file name without its extension
+int ltr_registry_add_dir(ltr_registry* r, const char* dirname);
+int ltr_registry_load_all(ltr_registry* r);
+u32 ltr_registry_count(const ltr_registry* r);
+const char* ltr_registry_name(const ltr_registry* r, u32 i);
+int ltr_registry_get(ltr_registry* r, const char* name, const ltrfile** out);
+void ltr_registry_put(ltr_registry* r, const ltrfile* l);
+
+// generators
+typedef struct ltrgen ltrgen;
+
+// running totals of a generator's work. With more than one thread these
+// include the names ltr_gen_batch generates and then throws away.
+typedef struct ltr_gen_stats
+{
+	u64 names;
+	u64 backtracks; // letters taken back after a failed roll
+	u64 restarts; // names given up on and started over
+	u64 pruned; // picks rolled again because they led to a state that can't end the name (prune only)
+	u64 forced_ends; // names ended because they couldn't go on, where the roll said to go on (prune only)
+	u64 duplicates; // names thrown away for having been handed out before (unique only)
+	u64 excluded; // names thrown away for being in the exclusion filter (unique only)
+} ltr_gen_stats;
+
+int ltr_gen_new(const ltrfile* l, const ltr_gen_opts* o, u32 seed, ltrgen** out);
+void ltr_gen_free(ltrgen* g);
+ms_rng* ltr_gen_rng(ltrgen* g);
+u32 ltr_gen_name(ltrgen* g, char* name);
+u32 ltr_gen_batch(ltrgen* g, ltr_batch* b, u32 n);
+void ltr_gen_get_stats(const ltrgen* g, ltr_gen_stats* s);
+
+/* tracing
+ *
+ * The generation (LTR_V_GEN, LTR_V_GEN2) and analysis math (LTR_V_MATH)
+ * diagnostics come once per letter or guess, and printing each as it
+ * happens slows the work down many times over. Once ltr_trace_start is
+ * called, they are instead recorded unformatted in a ring buffer per thread
+ * and written out later: by a background thread, or else by
+ * ltr_trace_flush, ltr_trace_stop, exit and crashes. With the background
+ * thread, a thread whose ring is full waits for it to catch up, so every
+ * record is kept; without it, a full ring loses its oldest records, and the
+ * trace says how many were lost. Other diagnostics still print straight
+ * away.
+ */
+#define LTR_TRACE_RECORDS (1 << 14) // a good ring size; each record takes 128 bytes
+
+int ltr_trace_start(FILE* out, u32 ring_records, bool background);
+void ltr_trace_flush(void);
+void ltr_trace_stop(void);
+
+/* metrics
+ *
+ * Builds of the library with LTR_METRICS defined (make METRICS=1) keep
+ * process-wide counters and histograms of how names are generated, and
+ * timings of each load phase and of generating, cheaply enough to leave on
+ * in production. A generator's numbers are added in when it is freed. In
+ * other builds none of it is compiled in, and ltr_metrics_write only says
+ * that metrics are disabled.
+ */
+#define LTR_METRICS_JSON (0)
+#define LTR_METRICS_PROM (1) // Prometheus text format
+
+bool ltr_metrics_enabled(void);
+void ltr_metrics_reset(void);
+bool ltr_metrics_write(FILE* out, u32 format);
+
+/* unique names
+ *
+ * A generator in unique mode never hands out the same name twice (ignoring
+ * case), nor any name in its exclusion filter, if it has one. An exclusion
+ * filter is a Bloom filter: it takes about 1.44 * log2(1 / fp_rate) bits per
+ * name, and wrongly excludes a name with a chance of about fp_rate. When a
+ * model runs out of new names the generator gives up and ltr_gen_exhausted
+ * says so; ltr_gen_batch then returns fewer names than asked for.
+ */
+typedef struct ltr_filter ltr_filter;
+
+int ltr_filter_new(u64 expected, double fp_rate, ltr_filter** out);
+int ltr_filter_load(const char* filename, double fp_rate, ltr_filter** out);
+void ltr_filter_free(ltr_filter* f);
+void ltr_filter_add(ltr_filter* f, const char* name);
+bool ltr_filter_has(const ltr_filter* f, const char* name);
+int ltr_gen_unique(ltrgen* g, const ltr_filter* exclude);
+bool ltr_gen_exhausted(const ltrgen* g);
+
+/* name probabilities
+ *
+ * An ltr_prob works out exactly how likely a generator with some set of
+ * options is to produce any given name, following the same rules as
+ * ltr_gen_name including its backing up and starting over, and can list the
+ * most likely names of a model. It describes the cdf, lut and sparse
+ * samplers without pruning; other options give LTR_E_PARAM. Like a model,
+ * it is read-only once made, and can be shared between threads.
+ */
+typedef struct ltr_prob ltr_prob;
+
+typedef struct ltr_ranked_name
+{
+	char name[LTR_NAME_MAX];
+	double prob;
+} ltr_ranked_name;
+
+int ltr_prob_new(const ltrfile* l, const ltr_gen_opts* o, ltr_prob** out);
+void ltr_prob_free(ltr_prob* p);
+double ltr_prob_name(const ltr_prob* p, const char* name);
+int ltr_prob_top(const ltr_prob* p, u32 k, ltr_ranked_name* out, u32* found);
+
+#endif // NWN_LTR_H
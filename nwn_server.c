@@ -0,0 +1,700 @@
+// license:BSD-3-Clause
+// copyright-holders:Jonathan Gevaryahu
+// (C) 2020-2022 Jonathan Gevaryahu AKA Lord Nightmare
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "nwn_ltr.h"
+
+// name server for libnwnltr (nwn_ltr.c)
+//
+// Loads any number of .ltr files once and answers requests for names over a
+// Unix domain socket, so a request costs only the names themselves rather
+// than a process start and a model load. The protocol is line based text,
+// one request per line:
+//   GEN <model> <count> [<seed> [<maxlen>]]
+//     -> "OK <count>", then that many names, one per line
+//   MODELS
+//     -> "OK <count>", then the name of each model, one per line
+//   METRICS [json]
+//     -> "OK <count>", then that many lines of the library's metrics, in the
+//        Prometheus text format or as JSON (see ltr_metrics_write)
+// and a request that can't be answered gets a single "ERR <reason>" line.
+// The names for a given model, count, seed and maxlen are the same as
+// nwn_getname -s seed -l maxlen -g count would give; a missing seed is
+// picked by the server, and maxlen defaults to 12.
+//
+// Models are kept in an ltr_registry: a directory on the command line adds
+// every .ltr file in it, files with the same contents share one loaded
+// model, and with -m the least recently used models are freed to stay under
+// a memory cap, to be loaded again by the worker that next needs them.
+//
+// One thread polls the listening socket and every connection, and queues
+// each complete request line; a pool of workers takes queued requests off in
+// batches, generates the names and writes the replies, so the poller never
+// waits on a client that isn't reading. A connection has at most one request
+// queued or being answered at a time, and isn't read from meanwhile, so
+// requests can be pipelined and are answered in order. A request line that
+// is too long is answered with an error, after which the connection only
+// waits for the client to hang up.
+
+#define SERVE_MAX_CONNS  (1024)
+#define SERVE_LINE_MAX   (256) // longest request line
+#define SERVE_MAX_COUNT  (1000000) // most names a single request can ask for
+#define SERVE_BATCH      (16) // requests a worker takes off the queue at once
+#define SERVE_WRITE_WAIT (10000) // ms a worker waits for a slow reader before dropping it
+
+typedef struct s_cfg
+{
+	const char* socket;
+	u32 workers;
+	bool fix;
+	u32 memcap; // MiB; 0 for no cap
+	u32 verbose;
+} s_cfg;
+
+typedef struct conn
+{
+	int fd; // -1 if the slot is free
+	char in[SERVE_LINE_MAX];
+	u32 in_len;
+	bool busy; // a request of this connection is queued or being answered
+	bool hangup; // the peer is done sending; close once idle
+	bool discard; // the last reply has been sent; ignore anything else until the peer hangs up
+} conn;
+
+enum { JOB_GEN, JOB_MODELS, JOB_METRICS, JOB_ERR };
+
+typedef struct job
+{
+	u32 kind; // JOB_*
+	u32 conn;
+	int fd;
+	const char* err; // the whole reply of a JOB_ERR
+	char model[64];
+	u32 count;
+	u32 seed;
+	u32 maxlen;
+	u32 format; // LTR_METRICS_* of a JOB_METRICS
+} job;
+
+typedef struct server
+{
+	s_cfg c;
+	ltr_registry* reg;
+	conn conns[SERVE_MAX_CONNS];
+	// queued requests; each connection has at most one, so this never fills
+	job queue[SERVE_MAX_CONNS];
+	u32 queue_head;
+	u32 queue_count;
+	bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int done_pipe[2]; // workers write the conn (with SERVE_DROP set on failure) of each answered request
+	u32 next_seed;
+} server;
+
+#define SERVE_DROP (1u << 31)
+
+// SIGINT and SIGTERM stop the server; the handler wakes the poller through
+// a pipe of its own
+static volatile sig_atomic_t stop_signal = 0;
+static int signal_pipe[2] = { -1, -1 };
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop_signal = 1;
+	char x = 0;
+	if (write(signal_pipe[1], &x, 1) < 0)
+		return; // the pipe is full, so the poller is awake anyway
+}
+
+void usage()
+{
+	printf("Usage: nwn_server [options] -S socket [name=]file.ltr|directory ...\n");
+	printf("Serve names from one or more .ltr files, or directories of them, over a Unix domain socket\n");
+	printf("Models are requested by name, which defaults to the file name without .ltr\n");
+	printf("Optional parameters:\n");
+	printf("-S path\t: listen on the Unix domain socket at path (required)\n");
+	printf("-j #\t: answer requests with # worker threads (Default: 4)\n");
+	printf("-m #\t: keep at most about # MiB of models loaded, freeing the least recently used (Default: no limit)\n");
+	printf("-T file\t: buffer the generation and math diagnostics in memory and write them to file from a background thread\n");
+	printf("-f\t: if the ltr files have corrupt singles tables, do not fix them\n");
+	printf("-v #\t: verbose bitmask, as for nwn_getname; 2 logs every request\n");
+}
+
+// write all of a buffer to a non-blocking socket
+static bool write_all(int fd, const char* buf, size_t len)
+{
+	while (len)
+	{
+		ssize_t n = write(fd, buf, len);
+		if (n > 0)
+		{
+			buf += n;
+			len -= n;
+			continue;
+		}
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		{
+			struct pollfd p = { fd, POLLOUT, 0 };
+			if (poll(&p, 1, SERVE_WRITE_WAIT) > 0)
+				continue;
+		}
+		return false;
+	}
+	return true;
+}
+
+static bool write_str(int fd, const char* s)
+{
+	return write_all(fd, s, strlen(s));
+}
+
+// one worker's reusable space
+typedef struct worker_scratch
+{
+	ltr_batch batch;
+	char* out;
+	size_t out_cap;
+} worker_scratch;
+
+static bool scratch_reserve(worker_scratch* w, size_t len)
+{
+	if (len <= w->out_cap)
+		return true;
+	size_t cap = w->out_cap ? w->out_cap : 4096;
+	while (cap < len)
+		cap *= 2;
+	char* out = realloc(w->out, cap);
+	if (out == NULL)
+		return false;
+	w->out = out;
+	w->out_cap = cap;
+	return true;
+}
+
+// generate and send the names for one request
+static bool answer(ltr_registry* reg, worker_scratch* w, const job* j)
+{
+	const ltrfile* l;
+	int err = ltr_registry_get(reg, j->model, &l);
+	if (err == LTR_E_NOMODEL)
+		return write_str(j->fd, "ERR no such model\n");
+	if (err != LTR_OK)
+		return write_str(j->fd, "ERR unable to load the model\n");
+	ltr_gen_opts go = { j->maxlen, SAMPLER_LUT, false, 1, 0 };
+	ltrgen* g = NULL;
+	if (ltr_gen_new(l, &go, j->seed, &g) != LTR_OK)
+	{
+		ltr_registry_put(reg, l);
+		return write_str(j->fd, "ERR unable to create a name generator\n");
+	}
+	size_t len = snprintf(w->out, w->out_cap, "OK %u\n", j->count);
+	u32 left = j->count;
+	while (left)
+	{
+		ltr_batch_clear(&w->batch);
+		u32 made = ltr_gen_batch(g, &w->batch, left);
+		size_t chars = w->batch.offsets[made] - w->batch.offsets[0];
+		if (!made || !scratch_reserve(w, len + chars + made))
+			break;
+		for (u32 i = 0; i < made; i++)
+		{
+			u32 n = w->batch.offsets[i+1] - w->batch.offsets[i];
+			memcpy(w->out + len, w->batch.chars + w->batch.offsets[i], n);
+			len += n;
+			w->out[len++] = '\n';
+		}
+		left -= made;
+	}
+	ltr_gen_free(g);
+	ltr_registry_put(reg, l);
+	if (left)
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for %u names!\n", j->count);
+		return write_str(j->fd, "ERR out of memory\n");
+	}
+	return write_all(j->fd, w->out, len);
+}
+
+// send the name of every model
+static bool answer_models(ltr_registry* reg, worker_scratch* w, const job* j)
+{
+	u32 num = ltr_registry_count(reg);
+	if (!scratch_reserve(w, 16 + (size_t)num * 64))
+		return write_str(j->fd, "ERR out of memory\n");
+	size_t len = sprintf(w->out, "OK %u\n", num);
+	for (u32 m = 0; m < num; m++)
+		len += sprintf(w->out + len, "%s\n", ltr_registry_name(reg, m));
+	return write_all(j->fd, w->out, len);
+}
+
+// send the library's metrics
+static bool answer_metrics(const job* j)
+{
+	char* text = NULL;
+	size_t text_len = 0;
+	FILE* out = open_memstream(&text, &text_len);
+	if (out == NULL)
+		return write_str(j->fd, "ERR out of memory\n");
+	bool written = ltr_metrics_write(out, j->format);
+	fclose(out);
+	if (!written || (text == NULL))
+	{
+		free(text);
+		return write_str(j->fd, "ERR out of memory\n");
+	}
+	u32 lines = 0;
+	for (size_t n = 0; n < text_len; n++)
+		lines += (text[n] == '\n');
+	char head[32];
+	bool ok = write_all(j->fd, head, sprintf(head, "OK %u\n", lines)) && write_all(j->fd, text, text_len);
+	free(text);
+	return ok;
+}
+
+static bool reply(ltr_registry* reg, worker_scratch* w, const job* j)
+{
+	switch (j->kind)
+	{
+		case JOB_GEN: return answer(reg, w, j);
+		case JOB_MODELS: return answer_models(reg, w, j);
+		case JOB_METRICS: return answer_metrics(j);
+		default: return write_str(j->fd, j->err);
+	}
+}
+
+static void* worker_run(void* arg)
+{
+	server* s = arg;
+	worker_scratch w = { { NULL, 0, NULL, 0, 0 }, NULL, 0 };
+	if (!ltr_batch_init(&w.batch, 1 << 16, 1 << 12))
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for a worker!\n");
+		return NULL;
+	}
+	if (!scratch_reserve(&w, 1 << 16))
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for a worker!\n");
+		ltr_batch_free(&w.batch);
+		return NULL;
+	}
+	for (;;)
+	{
+		job jobs[SERVE_BATCH];
+		u32 n = 0;
+		pthread_mutex_lock(&s->lock);
+		while (!s->queue_count && !s->stopping)
+			pthread_cond_wait(&s->ready, &s->lock);
+		for (; s->queue_count && (n < SERVE_BATCH); n++)
+		{
+			jobs[n] = s->queue[s->queue_head];
+			s->queue_head = (s->queue_head + 1) % SERVE_MAX_CONNS;
+			s->queue_count--;
+		}
+		pthread_mutex_unlock(&s->lock);
+		if (!n)
+			break; // stopping, and nothing left to answer
+		for (u32 i = 0; i < n; i++)
+		{
+			u32 done = jobs[i].conn | (reply(s->reg, &w, &jobs[i]) ? 0 : SERVE_DROP);
+			if (write(s->done_pipe[1], &done, sizeof(done)) != sizeof(done))
+				eprintf(V_ERR,"E* Unable to hand a finished request back!\n");
+		}
+	}
+	ltr_batch_free(&w.batch);
+	free(w.out);
+	return NULL;
+}
+
+static void conn_close(server* s, u32 i)
+{
+	const s_cfg c = s->c;
+	close(s->conns[i].fd);
+	s->conns[i].fd = -1;
+	eprintf(V_PARAM,"D* connection %u closed\n", i);
+}
+
+// queue a request for the workers; the connection is busy until it has
+// been answered
+static void queue_job(server* s, const job* j)
+{
+	pthread_mutex_lock(&s->lock);
+	s->queue[(s->queue_head + s->queue_count) % SERVE_MAX_CONNS] = *j;
+	s->queue_count++;
+	pthread_cond_signal(&s->ready);
+	pthread_mutex_unlock(&s->lock);
+	s->conns[j->conn].busy = true;
+}
+
+// handle one request line; anything but a blank line is queued, and leaves
+// the connection busy
+static void request(server* s, u32 i, char* line)
+{
+	const s_cfg c = s->c;
+	conn* k = &s->conns[i];
+	char cmd[16], model[64];
+	u32 count = 0, seed = 0, maxlen = 12;
+	int fields = sscanf(line, "%15s %63s %u %u %u", cmd, model, &count, &seed, &maxlen);
+	eprintf(V_GEN,"D* connection %u: %s\n", i, line);
+	if (fields < 1)
+		return; // blank lines are ignored
+	job j = { JOB_GEN, i, k->fd, NULL, { 0 }, count, seed, maxlen, LTR_METRICS_PROM };
+	if (!strcmp(cmd, "MODELS"))
+		j.kind = JOB_MODELS;
+	else if (!strcmp(cmd, "METRICS"))
+	{
+		j.kind = JOB_METRICS;
+		if ((fields > 1) && !strcmp(model, "json"))
+			j.format = LTR_METRICS_JSON;
+	}
+	else if (strcmp(cmd, "GEN"))
+		j = (job){ JOB_ERR, i, k->fd, "ERR unknown request\n", { 0 }, 0, 0, 0, 0 };
+	else if (fields < 3)
+		j = (job){ JOB_ERR, i, k->fd, "ERR usage: GEN <model> <count> [<seed> [<maxlen>]]\n", { 0 }, 0, 0, 0, 0 };
+	else if ((count < 1) || (count > SERVE_MAX_COUNT) || (maxlen < 1))
+		j = (job){ JOB_ERR, i, k->fd, "ERR count or maxlen out of range\n", { 0 }, 0, 0, 0, 0 };
+	else
+	{
+		if (fields < 4)
+			j.seed = s->next_seed++;
+		strcpy(j.model, model);
+	}
+	queue_job(s, &j);
+}
+
+// handle whatever complete request lines an idle connection has buffered,
+// up to the first one that has to wait for a worker
+static void conn_drain(server* s, u32 i)
+{
+	conn* k = &s->conns[i];
+	if (k->discard)
+	{
+		// closing with unread input would reset the connection, and the
+		// client could lose the error before reading it
+		k->in_len = 0;
+		if (k->hangup)
+			conn_close(s, i);
+		return;
+	}
+	while (!k->busy && (k->fd >= 0))
+	{
+		char* nl = memchr(k->in, '\n', k->in_len);
+		if (nl == NULL)
+		{
+			if (k->in_len == SERVE_LINE_MAX)
+			{
+				k->discard = true;
+				k->in_len = 0;
+				queue_job(s, &(job){ JOB_ERR, i, k->fd, "ERR request too long\n", { 0 }, 0, 0, 0, 0 });
+			}
+			else if (k->hangup)
+				conn_close(s, i);
+			return;
+		}
+		*nl = '\0';
+		if ((nl > k->in) && (nl[-1] == '\r'))
+			nl[-1] = '\0';
+		char line[SERVE_LINE_MAX];
+		strcpy(line, k->in);
+		k->in_len -= (nl + 1) - k->in;
+		memmove(k->in, nl + 1, k->in_len);
+		request(s, i, line);
+	}
+}
+
+static int listen_on(const char* path)
+{
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "E* Socket path %s is too long!\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	unlink(path); // a leftover socket from an earlier run
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 128) || (fcntl(fd, F_SETFL, O_NONBLOCK) < 0))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void serve(server* s, int lfd)
+{
+	const s_cfg c = s->c;
+	struct pollfd fds[3 + SERVE_MAX_CONNS];
+	u32 which[SERVE_MAX_CONNS];
+	while (!stop_signal)
+	{
+		fds[0] = (struct pollfd){ lfd, POLLIN, 0 };
+		fds[1] = (struct pollfd){ s->done_pipe[0], POLLIN, 0 };
+		fds[2] = (struct pollfd){ signal_pipe[0], POLLIN, 0 };
+		u32 nfds = 3;
+		for (u32 i = 0; i < SERVE_MAX_CONNS; i++)
+		{
+			if ((s->conns[i].fd >= 0) && !s->conns[i].busy)
+			{
+				which[nfds - 3] = i;
+				fds[nfds++] = (struct pollfd){ s->conns[i].fd, POLLIN, 0 };
+			}
+		}
+		if (poll(fds, nfds, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			eprintf(V_ERR,"E* poll failed!\n");
+			break;
+		}
+		// requests the workers have finished
+		if (fds[1].revents & POLLIN)
+		{
+			u32 done[64];
+			ssize_t n = read(s->done_pipe[0], done, sizeof(done));
+			for (ssize_t d = 0; d < n / (ssize_t)sizeof(u32); d++)
+			{
+				conn* k = &s->conns[done[d] & ~SERVE_DROP];
+				k->busy = false;
+				if (done[d] & SERVE_DROP) // the reply couldn't be sent, so there's no point reading more
+				{
+					k->hangup = true;
+					k->in_len = 0;
+				}
+				else if (k->discard)
+					shutdown(k->fd, SHUT_WR); // the client sees the end of the replies
+				conn_drain(s, done[d] & ~SERVE_DROP);
+			}
+		}
+		// new connections
+		if (fds[0].revents & POLLIN)
+		{
+			for (;;)
+			{
+				int fd = accept(lfd, NULL, NULL);
+				if (fd < 0)
+					break;
+				u32 i = 0;
+				while ((i < SERVE_MAX_CONNS) && (s->conns[i].fd >= 0))
+					i++;
+				if ((i == SERVE_MAX_CONNS) || (fcntl(fd, F_SETFL, O_NONBLOCK) < 0))
+				{
+					write_str(fd, "ERR too many connections\n");
+					close(fd);
+					continue;
+				}
+				s->conns[i] = (conn){ fd, { 0 }, 0, false, false, false };
+				eprintf(V_PARAM,"D* connection %u opened\n", i);
+			}
+		}
+		// requests from idle connections
+		for (u32 f = 3; f < nfds; f++)
+		{
+			u32 i = which[f - 3];
+			conn* k = &s->conns[i];
+			if (!fds[f].revents || (k->fd < 0) || k->busy)
+				continue;
+			ssize_t n = read(k->fd, k->in + k->in_len, SERVE_LINE_MAX - k->in_len);
+			if (n > 0)
+				k->in_len += n;
+			else if ((n == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+				k->hangup = true;
+			conn_drain(s, i);
+		}
+	}
+}
+
+#define MIN_PARAMETERS 3
+int main(int argc, char **argv)
+{
+	// defaults
+	s_cfg c =
+	{
+		NULL // socket
+		, 4 // workers
+		, true // fix
+		, 0 // memcap
+		, 8 /*8 == V_FIX*/ // verbose
+	};
+	static server s;
+	const char* models[argc];
+	const char* tracefile = NULL;
+	u32 num_models = 0;
+
+	if (argc < MIN_PARAMETERS+1)
+	{
+		eprintf(V_ERR,"E* Incorrect number of parameters!\n");
+		usage();
+		return 1;
+	}
+
+// handle parameters; anything not starting with - is a model
+	for (int paramidx = 1; paramidx < argc; paramidx++)
+	{
+		const char* p = argv[paramidx];
+		if (p[0] != '-')
+		{
+			models[num_models++] = p;
+			continue;
+		}
+		switch (p[1])
+		{
+			case 'S':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -S parameter!\n"); usage(); exit(1); }
+				c.socket = argv[paramidx];
+				break;
+			case 'j':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -j parameter!\n"); usage(); exit(1); }
+				if (!sscanf(argv[paramidx], "%d", &c.workers) || !c.workers || (c.workers > 1024)) { eprintf(V_ERR,"E* Unable to parse argument for -j parameter!\n"); usage(); exit(1); }
+				break;
+			case 'm':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -m parameter!\n"); usage(); exit(1); }
+				if (!sscanf(argv[paramidx], "%d", &c.memcap)) { eprintf(V_ERR,"E* Unable to parse argument for -m parameter!\n"); usage(); exit(1); }
+				break;
+			case 'T':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -T parameter!\n"); usage(); exit(1); }
+				tracefile = argv[paramidx];
+				break;
+			case 'f':
+				c.fix = false;
+				break;
+			case 'v':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -v parameter!\n"); usage(); exit(1); }
+				if (!sscanf(argv[paramidx], "%d", &c.verbose)) { eprintf(V_ERR,"E* Unable to parse argument for -v parameter!\n"); usage(); exit(1); }
+				break;
+			default:
+				{ eprintf(V_ERR,"E* Invalid option!\n"); usage(); exit(1); }
+				break;
+		}
+	}
+	if (!c.socket || !num_models)
+	{
+		eprintf(V_ERR,"E* A socket and at least one model are required!\n");
+		usage();
+		return 1;
+	}
+
+	if (tracefile)
+	{
+		FILE* out = fopen(tracefile, "w");
+		if (!out || (ltr_trace_start(out, LTR_TRACE_RECORDS, true) != LTR_OK))
+		{
+			eprintf(V_ERR,"E* Unable to write trace file %s!\n", tracefile);
+			return 1;
+		}
+	}
+
+	// register them all, then load as many up front as the cap allows
+	ltr_opts o = { c.fix, c.workers, c.verbose };
+	if (ltr_registry_new(&o, (size_t)c.memcap << 20, &s.reg) != LTR_OK)
+	{
+		eprintf(V_ERR,"E* Failure to allocate memory for the models!\n");
+		return 1;
+	}
+	for (u32 m = 0; m < num_models; m++)
+	{
+		const char* eq = strchr(models[m], '=');
+		char name[64];
+		struct stat st;
+		int err;
+		if (eq && ((size_t)(eq - models[m]) < sizeof(name)))
+		{
+			memcpy(name, models[m], eq - models[m]);
+			name[eq - models[m]] = '\0';
+			err = ltr_registry_add(s.reg, name, eq + 1);
+		}
+		else if (!stat(models[m], &st) && S_ISDIR(st.st_mode))
+			err = ltr_registry_add_dir(s.reg, models[m]);
+		else
+			err = ltr_registry_add(s.reg, NULL, models[m]);
+		if (err != LTR_OK)
+		{
+			eprintf(V_ERR,"E* Unable to add %s: %s!\n", models[m], ltr_strerror(err));
+			return 1;
+		}
+	}
+	if (!ltr_registry_count(s.reg))
+	{
+		eprintf(V_ERR,"E* No models to serve!\n");
+		return 1;
+	}
+	int err = ltr_registry_load_all(s.reg);
+	if (err != LTR_OK)
+	{
+		eprintf(V_ERR,"E* Unable to load the models: %s!\n", ltr_strerror(err));
+		return 1;
+	}
+	for (u32 m = 0; m < ltr_registry_count(s.reg); m++)
+		eprintf(V_PARAM,"D* serving %s\n", ltr_registry_name(s.reg, m));
+
+	s.c = c;
+	s.next_seed = time(NULL);
+	for (u32 i = 0; i < SERVE_MAX_CONNS; i++)
+		s.conns[i].fd = -1;
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.ready, NULL);
+	int lfd = listen_on(c.socket);
+	if ((lfd < 0) || pipe(s.done_pipe) || pipe(signal_pipe) || (fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK) < 0))
+	{
+		eprintf(V_ERR,"E* Unable to listen on %s!\n", c.socket);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	pthread_t tid[c.workers];
+	u32 started = 0;
+	for (; started < c.workers; started++)
+	{
+		if (pthread_create(&tid[started], NULL, worker_run, &s))
+			break;
+	}
+	if (!started)
+	{
+		eprintf(V_ERR,"E* Unable to start any workers!\n");
+		return 1;
+	}
+	eprintf(V_PARAM,"D* listening on %s with %u workers\n", c.socket, started);
+
+	serve(&s, lfd);
+
+	// let the workers finish what is queued, then tidy up
+	pthread_mutex_lock(&s.lock);
+	s.stopping = true;
+	pthread_cond_broadcast(&s.ready);
+	pthread_mutex_unlock(&s.lock);
+	for (u32 w = 0; w < started; w++)
+		pthread_join(tid[w], NULL);
+	for (u32 i = 0; i < SERVE_MAX_CONNS; i++)
+	{
+		if (s.conns[i].fd >= 0)
+			close(s.conns[i].fd);
+	}
+	close(lfd);
+	unlink(c.socket);
+	ltr_registry_free(s.reg);
+	eprintf(V_PARAM,"D* stopped\n");
+	return 0;
+}
@@ -0,0 +1,254 @@
+// license:BSD-3-Clause
+// copyright-holders:Jonathan Gevaryahu
+// (C) 2020-2022 Jonathan Gevaryahu AKA Lord Nightmare
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "nwn_ltr.h"
+
+// .ltr trainer for libnwnltr (nwn_ltr.c)
+//
+// Counts the letters of one or more lists of names, one name per line, and
+// writes the .ltr file a generator would need to make names like them. Names
+// are case folded; lines with letters outside the alphabet, or with fewer
+// than 4 or more than LTR_NAME_MAX - 1 letters, are skipped. Files are
+// counted across threads; a list read from standard input is counted a block
+// at a time, so it never has to fit in memory.
+//
+// With -u, the names are added to (and with -r, removed from) an existing
+// model instead; only the rows they touch are worked out again, from the
+// model's own counts, so a handful of names costs next to nothing.
+
+#define TRAIN_BLOCK (1 << 26) // bytes of standard input counted at once
+
+typedef struct s_cfg
+{
+	u32 letters;
+	u32 threads;
+	const char* countsfile;
+	const char* model;
+	const char* modelcounts;
+	bool fix;
+	u32 verbose;
+} s_cfg;
+
+void usage()
+{
+	printf("Usage: nwn_train [options] out.ltr names.txt|- ...\n");
+	printf("Build an .ltr file from lists of names, one per line (- for standard input)\n");
+	printf("Optional parameters:\n");
+	printf("-n #\t: letters in the alphabet, 26 (a-z) or 28 (a-z, ' and -) (Default: 28)\n");
+	printf("-j #\t: count using # threads; the output is the same for any number (Default: 1)\n");
+	printf("-c file\t: also write the exact counts to file, for nwn_getname -N\n");
+	printf("-u file\t: update the model in file with the names, rather than training a new one\n");
+	printf("-N file\t: use the exact counts in file, written by -c, for the -u model instead of analyzing it\n");
+	printf("-r file\t: remove the names in file from the -u model; may be given more than once\n");
+	printf("-f\t: if the -u model has corrupt singles tables, do not fix them\n");
+	printf("-v #\t: verbose bitmask; 1 prints how many names were counted and skipped\n");
+}
+
+// count standard input a block at a time, carrying any partial last line
+// over to the next block
+static int count_stdin(ltr_counts* t, s32 weight, u32 threads, u64* added, u64* skipped)
+{
+	char* buf = malloc(TRAIN_BLOCK);
+	if (!buf)
+		return LTR_E_ALLOC;
+	size_t have = 0;
+	int ret = LTR_OK;
+	for (;;)
+	{
+		size_t n = fread(buf + have, 1, TRAIN_BLOCK - have, stdin);
+		have += n;
+		bool last = (n == 0) || feof(stdin) || ferror(stdin);
+		size_t upto = have;
+		if (!last)
+		{
+			while ((upto > 0) && (buf[upto - 1] != '\n'))
+				upto--;
+			if (upto == 0)
+				upto = have; // a single line longer than the block; no name is that long anyway
+		}
+		ret = ltr_counts_add_text(t, buf, upto, weight, threads, added, skipped);
+		if ((ret != LTR_OK) || last)
+			break;
+		memmove(buf, buf + upto, have - upto);
+		have -= upto;
+	}
+	if ((ret == LTR_OK) && ferror(stdin))
+		ret = LTR_E_OPEN;
+	free(buf);
+	return ret;
+}
+
+// count a list of names from a file, or from standard input for -
+static int count_list(ltr_counts* t, const char* filename, s32 weight, u32 threads, u64* added, u64* skipped)
+{
+	if (!strcmp(filename, "-"))
+		return count_stdin(t, weight, threads, added, skipped);
+	return ltr_counts_add_file(t, filename, weight, threads, added, skipped);
+}
+
+#define MIN_PARAMETERS 2
+int main(int argc, char **argv)
+{
+	// defaults
+	s_cfg c =
+	{
+		28 // letters
+		, 1 // threads
+		, NULL // countsfile
+		, NULL // model
+		, NULL // modelcounts
+		, true // fix
+		, 0 // verbose
+	};
+	const char* files[argc];
+	const char* removes[argc];
+	u32 num_files = 0;
+	u32 num_removes = 0;
+
+	if (argc < MIN_PARAMETERS+1)
+	{
+		eprintf(V_ERR,"E* Incorrect number of parameters!\n");
+		usage();
+		return 1;
+	}
+
+// handle parameters; anything not starting with -, and - itself, is a file
+	for (int paramidx = 1; paramidx < argc; paramidx++)
+	{
+		const char* p = argv[paramidx];
+		if ((p[0] != '-') || (p[1] == '\0'))
+		{
+			files[num_files++] = p;
+			continue;
+		}
+		switch (p[1])
+		{
+			case 'n':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -n parameter!\n"); usage(); exit(1); }
+				if (!sscanf(argv[paramidx], "%d", &c.letters) || ((c.letters != 26) && (c.letters != 28))) { eprintf(V_ERR,"E* Unable to parse argument for -n parameter!\n"); usage(); exit(1); }
+				break;
+			case 'j':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -j parameter!\n"); usage(); exit(1); }
+				if (!sscanf(argv[paramidx], "%d", &c.threads) || !c.threads || (c.threads > 1024)) { eprintf(V_ERR,"E* Unable to parse argument for -j parameter!\n"); usage(); exit(1); }
+				break;
+			case 'c':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -c parameter!\n"); usage(); exit(1); }
+				c.countsfile = argv[paramidx];
+				break;
+			case 'u':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -u parameter!\n"); usage(); exit(1); }
+				c.model = argv[paramidx];
+				break;
+			case 'N':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -N parameter!\n"); usage(); exit(1); }
+				c.modelcounts = argv[paramidx];
+				break;
+			case 'r':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -r parameter!\n"); usage(); exit(1); }
+				removes[num_removes++] = argv[paramidx];
+				break;
+			case 'f':
+				c.fix = false;
+				break;
+			case 'v':
+				if (++paramidx == argc) { eprintf(V_ERR,"E* Too few arguments for -v parameter!\n"); usage(); exit(1); }
+				if (!sscanf(argv[paramidx], "%d", &c.verbose)) { eprintf(V_ERR,"E* Unable to parse argument for -v parameter!\n"); usage(); exit(1); }
+				break;
+			default:
+				{ eprintf(V_ERR,"E* Invalid option!\n"); usage(); exit(1); }
+				break;
+		}
+	}
+	if ((num_files < 1) || ((num_files < 2) && !num_removes))
+	{
+		eprintf(V_ERR,"E* An output file and at least one list of names are required!\n");
+		usage();
+		return 1;
+	}
+	if (num_removes && !c.model)
+	{
+		eprintf(V_ERR,"E* Names can only be removed from a -u model!\n");
+		usage();
+		return 1;
+	}
+
+	// load it! (when updating); it is only written out again, so no names
+	// are generated from it and it needs no sampling tables
+	ltrfile* model = NULL;
+	if (c.model)
+	{
+		ltr_opts o = { c.fix, c.threads, c.verbose, true };
+		if ((c.modelcounts ? ltr_load_counted(c.model, c.modelcounts, &o, &model) : ltr_load_file(c.model, &o, &model)) != LTR_OK)
+			return 1;
+		c.letters = ltr_num_letters(model);
+	}
+
+	ltr_counts* t = NULL;
+	int err = ltr_counts_new(c.letters, &t);
+	if (err != LTR_OK)
+	{
+		eprintf(V_ERR,"E* Unable to set up counting: %s!\n", ltr_strerror(err));
+		ltr_free(model);
+		return 1;
+	}
+
+	// count it!
+	for (u32 i = 1; i < num_files; i++)
+	{
+		u64 added = 0, skipped = 0;
+		err = count_list(t, files[i], 1, c.threads, &added, &skipped);
+		if (err != LTR_OK)
+		{
+			eprintf(V_ERR,"E* Unable to count the names in %s: %s!\n", files[i], ltr_strerror(err));
+			ltr_counts_free(t);
+			ltr_free(model);
+			return 1;
+		}
+		eprintf(V_PARAM,"D* %s: counted %llu names, skipped %llu\n", files[i], (unsigned long long)added, (unsigned long long)skipped);
+	}
+	for (u32 i = 0; i < num_removes; i++)
+	{
+		u64 removed = 0, skipped = 0;
+		err = count_list(t, removes[i], -1, c.threads, &removed, &skipped);
+		if (err != LTR_OK)
+		{
+			eprintf(V_ERR,"E* Unable to count the names in %s: %s!\n", removes[i], ltr_strerror(err));
+			ltr_counts_free(t);
+			ltr_free(model);
+			return 1;
+		}
+		eprintf(V_PARAM,"D* %s: removing %llu names, skipped %llu\n", removes[i], (unsigned long long)removed, (unsigned long long)skipped);
+	}
+	if (!model && !ltr_counts_names(t))
+	{
+		eprintf(V_ERR,"E* There are no names to count!\n");
+		ltr_counts_free(t);
+		return 1;
+	}
+
+	// write it!
+	if (model)
+	{
+		ltr_opts o = { c.fix, c.threads, c.verbose, true };
+		ltrfile* updated = NULL;
+		err = ltr_update(model, t, &o, &updated);
+		if (err == LTR_OK)
+			err = ltr_write(updated, files[0], c.countsfile);
+		ltr_free(updated);
+		ltr_free(model);
+	}
+	else
+		err = ltr_counts_write(t, files[0], c.countsfile);
+	ltr_counts_free(t);
+	if (err != LTR_OK)
+	{
+		eprintf(V_ERR,"E* Unable to write %s: %s!\n", files[0], ltr_strerror(err));
+		return 1;
+	}
+	return 0;
+}